@@ -15,18 +15,163 @@
 // limitations under the License.
 
 #include <cassert>
-#include <vector>
 #include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <ctime>
 #include <GL/glew.h>
 #include <FFGL.h>
+#include <FFGLLib.h>
 #include "FFGLLightBrush.h"
 
 #define FFPARAM_THRESHOLD (0)
 #define FFPARAM_DARKENING (1)
 #define FFPARAM_CLEAR (2)
+#define FFPARAM_COMPUTE (3)
+#define FFPARAM_PRECISION (4)
+#define FFPARAM_VELOCITY_RESOLUTION (5)
+#define FFPARAM_EXPORT (6)
+#define FFPARAM_SPREAD (7)
+#define FFPARAM_HDR (8)
+#define FFPARAM_SKIP_DARK (9)
+#define FFPARAM_SPREAD_MIX (10)
+
+// The state buffers of the feedback effect. The color buffer is the output,
+// and the fragment shader writes buffer i to output location i and image
+// unit i.
+#define COLOR_BUFFER (0)
+#define VELOCITY_BUFFER (1)
+
+// Width and height of the pixel tiles that are skipped when they are dark.
+// Must match the local size in computeShaderSource and tileShaderSource, and
+// the tile size in tileVertexShaderSource and lightBrushShaderSource.
+#define TILE_SIZE (16)
+
+// The tile list buffer starts with the arguments of an indirect dispatch, the
+// arguments of an indirect draw at TILE_DRAW_COMMAND, and the step number,
+// followed by the listed tiles.
+#define TILE_DRAW_COMMAND (3)
+#define TILE_LIST_HEADER (8)
+
+// The simulation advances at a fixed rate when the host calls SetTime(), so
+// that the trails fade at the same speed regardless of the frame rate.
+#define SIMULATION_RATE (60.0)
+#define MAX_STEPS_PER_FRAME (4)
+
+// When profiling with a log file, the GPU time statistics are written after
+// every this many frames.
+#define PROFILE_LOG_INTERVAL (120)
+
+// With a nonzero spread, the shaders mix the color state towards a blurred
+// copy of it, by the fraction that the spread mix parameter gives. The copy is
+// blurred once per frame with a dual filter, which halves the resolution
+// between 1 and SPREAD_LEVELS times, as selected by the spread parameter, and
+// doubles it back to half the resolution of the state. The blur then covers
+// about 2 to 2^SPREAD_LEVELS pixels. The blurred copies are read through a
+// sampler object on SPREAD_UNIT.
+#define SPREAD_LEVELS (6)
+#define SPREAD_UNIT (4)
+
+// All the shaders read the parameters from a uniform block that is bound to
+// this uniform buffer binding point. The layout of the block must match the
+// ShaderParameters structure.
+#define PARAMETER_BLOCK_BINDING (0)
+#define PARAMETER_BLOCK \
+"layout(std140) uniform LightBrushParameters {" \
+"    float threshold;" \
+"    float darkening;" \
+"    vec2 inputScale;" \
+"    vec2 maskScale;" \
+"    float spreadLevels;" \
+"    float hdr;" \
+"    float spreadWeight;" \
+"};"
 
 using namespace std;
 
+// Internal formats of the color and velocity state textures for each setting
+// of the precision parameter, and the number of bytes they take per pixel.
+// The velocity stays below 0.001, so half float is enough unless the color is
+// stored in floating point as well.
+struct StatePrecision {
+	const char * name;
+	GLenum colorFormat;
+	GLenum velocityFormat;
+	GLuint colorBytes;
+	GLuint velocityBytes;
+};
+
+static const StatePrecision statePrecisions[] = {
+	{ "Low", GL_RGBA8, GL_R16F, 4, 2 },
+	{ "Standard", GL_RGBA8, GL_R32F, 4, 4 },
+	{ "High", GL_RGB10_A2, GL_R16F, 4, 2 },
+	{ "Float", GL_RGBA16F, GL_R32F, 8, 4 }
+};
+
+// Names of the profiled stages in the log file.
+static const char * stageNames[] = {
+	"tiles",
+	"simulate",
+	"velocity",
+	"color",
+	"copy",
+	"spread"
+};
+
+// Exported images are saved in the user's picture directory on Windows, and in
+// the home directory elsewhere, unless the host sets a directory.
+static string defaultExportDirectory()
+{
+#ifdef _WIN32
+	const char * home = getenv("USERPROFILE");
+	if (home != NULL)
+		return string(home) + "\\Pictures";
+#else
+	const char * home = getenv("HOME");
+	if (home != NULL)
+		return string(home);
+#endif
+	return ".";
+}
+
+// The number of images that all the instances have exported.
+static unsigned exportCount = 0;
+
+// Contents of the LightBrushParameters uniform block in the std140 layout.
+// The scales map the texture coordinates of the state to the part of the
+// input and mask textures that has content. The hdr flag is 1 in HDR mode
+// and 0 otherwise. The size of the block is rounded up to a multiple of 16
+// bytes.
+struct ShaderParameters {
+	GLfloat threshold;
+	GLfloat darkening;
+	GLfloat inputScale[2];
+	GLfloat maskScale[2];
+	GLfloat spreadLevels;
+	GLfloat hdr;
+	GLfloat spreadWeight;
+	GLfloat padding[3];
+};
+
+// Returns how many times the dual filter halves the resolution, or 0 when the
+// spread is off.
+static int spreadLevels(float spread)
+{
+	if (spread <= 0.0f)
+		return 0;
+	return 1 + int(spread * (SPREAD_LEVELS - 1) + 0.5f);
+}
+
+#define NUM_PRECISIONS (4)
+
+// HDR mode keeps the state in the formats of the highest precision setting.
+#define HDR_PRECISION (NUM_PRECISIONS - 1)
+
+// The velocity resolution parameter selects one of these divisors of the
+// viewport size.
+#define NUM_VELOCITY_DIVISORS (3)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //  Plugin information
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -44,71 +189,271 @@ static CFFGLPluginInfo PluginInfo(
 	"by Seppo Enarvi - users.marjaniemi.com/seppo" // About
 	);
 
+// The shader sources are prefixed with one of these headers. When rendering
+// directly to the host framebuffer, the shader needs image load/store for
+// writing the state textures.
+static const char * framebufferShaderHeader =
+"#version 330\n";
+
+static const char * directOutputShaderHeader =
+"#version 420\n"
+"#define DIRECT_OUTPUT\n";
+
+// The variant that skips dark tiles uses shader storage buffers.
+static const char * tileSkippingShaderHeader =
+"#version 430\n"
+"#define DIRECT_OUTPUT\n";
+
+// When the velocity is simulated at a reduced resolution, the light brush
+// shader is split in two passes by appending one of these definitions to the
+// header.
+static const char * velocityPassDefinition =
+"#define VELOCITY_PASS\n";
+
+static const char * colorPassDefinition =
+"#define COLOR_PASS\n";
+
+// The single pass shader is specialized for some parameter values by
+// appending these definitions to the header. A variant is identified by a
+// combination of the VARIANT flags, which index variantDefinitions.
+#define VARIANT_NO_DARKENING (1)
+#define VARIANT_ALWAYS_BURN (2)
+#define VARIANT_NO_VELOCITY (4)
+#define VARIANT_TILE_SKIPPING (8)
+#define NUM_VARIANT_FLAGS (4)
+
+static const char * variantDefinitions[] = {
+	"#define NO_DARKENING\n",
+	"#define ALWAYS_BURN\n",
+	"#define NO_VELOCITY\n",
+	"#define TILE_SKIPPING\n"
+};
+
+// A vertex shader that generates a triangle covering the whole viewport from
+// the vertex index, so no vertex buffers or matrices are needed.
 static const char * vertexShaderSource =
+"out vec2 texCoord;"
 "void main()"
 "{"
-"    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;"
-"    gl_TexCoord[0] = gl_MultiTexCoord0;"
-"    gl_FrontColor = gl_Color;"
+"    vec2 position = vec2((gl_VertexID & 1) * 4 - 1, (gl_VertexID & 2) * 2 - 1);"
+"    texCoord = position * 0.5 + 0.5;"
+"    gl_Position = vec4(position, 0.0, 1.0);"
 "}";
 
-// A fragment shader that updates the velocity texture.
-static const char * velocityShaderSource =
+// A vertex shader that draws one 16x16 tile of the viewport per instance. The
+// tile comes from the tile list as an instanced attribute, and the vertex
+// index selects a corner of a triangle strip. The tiles on the right and top
+// edges are cut at the edge of the state.
+static const char * tileVertexShaderSource =
+"layout(location = 0) in uint packedTile;"
+"uniform sampler2D stateSampler;"
+"out vec2 texCoord;"
+"void main()"
+"{"
+"    vec2 size = vec2(textureSize(stateSampler, 0));"
+"    ivec2 tile = ivec2(packedTile & 0xFFFFu, packedTile >> 16);"
+"    vec2 corner = vec2((tile + ivec2(gl_VertexID & 1, gl_VertexID >> 1)) * 16);"
+"    texCoord = min(corner, size) / size;"
+"    gl_Position = vec4(texCoord * 2.0 - 1.0, 0.0, 1.0);"
+"}";
+
+// A fragment shader that updates both the velocity and the color state in a
+// single pass. The input, state, and neighbour texels are fetched only once
+// per pixel. Normally the output color is written to the first draw buffer
+// and the new velocity to the second one. With DIRECT_OUTPUT the output color
+// goes to the host framebuffer and the state textures are written as images,
+// so there is no need to copy the output afterwards.
+//
+// With VELOCITY_PASS the shader only writes the new velocity, at the
+// resolution of the velocity textures. With COLOR_PASS it reads the new
+// velocity with bilinear filtering instead of computing it.
+//
+// The neighbours are the four adjacent texels. The state textures use border
+// addressing, so the neighbours outside the texture read as opaque black
+// without branching. At full resolution the neighbours are fetched with
+// constant texel offsets. The original shader moved the taps by 1.0 in
+// texture coordinates instead of one texel, which read the top and left
+// neighbours as black and the other two as the pixel itself, so the light
+// did not spread in the first release.
+//
+// The input luminance is scaled by the luminance of the mask, so the input
+// burns in and pulls the state only where the mask is bright. The mask also
+// gates the burn test on its own, so that nothing burns in where the mask is
+// black, even when the threshold is 0.
+//
+// NO_DARKENING leaves out the multiplication when the darkening is 1, and
+// ALWAYS_BURN the comparison when the threshold is 0 and there is no mask, so
+// that every pixel burns in. NO_VELOCITY skips the neighbour fetches and does
+// not write the velocity. It is used when the velocity cannot change the
+// output.
+//
+// TILE_SKIPPING is drawn with tileVertexShaderSource over the tiles that
+// tileShaderSource has listed, and records the step number of every tile
+// where some pixel is lit, like the compute shader. The texture coordinates
+// are computed from the fragment position, because interpolating them over
+// the tiles does not round exactly like over the viewport triangle.
+//
+// With a nonzero spread, the color is mixed towards the blurred state before
+// the velocity is added. The blurred state is read in one bilinear fetch, so
+// the cost of a step does not depend on the radius.
+//
+// In HDR mode the state is stored in floating point, and the input is added
+// to the darkened state where it burns in, so overlapping strokes accumulate
+// above 1. The pass that writes the host framebuffer maps the state to the
+// output range with the curve 1 - exp(-x).
+static const char * lightBrushShaderSource =
+"in vec2 texCoord;"
 "uniform sampler2D inputSampler;"
 "uniform sampler2D stateSampler;"
 "uniform sampler2D velocitySampler;"
+"uniform sampler2D maskSampler;"
+"uniform sampler2D spreadSampler;"
+PARAMETER_BLOCK
+"\n#ifdef DIRECT_OUTPUT\n"
+"layout(binding = 0) writeonly uniform image2D colorImage;"
+"layout(binding = 1) writeonly uniform image2D velocityImage;"
+"layout(location = 0) out vec4 hostColor;"
+"\n#ifdef TILE_SKIPPING\n"
+"layout(std430, binding = 0) writeonly buffer TileSteps { uint tileSteps[]; };"
+"layout(std430, binding = 1) readonly buffer TileList {"
+"    uint indirectArguments[7];"
+"    uint step;"
+"};"
+"const float activityEpsilon = 0.5 / 255.0;"
+"\n#endif\n"
+"\n#else\n"
+"layout(location = 0) out vec4 colorOutput;"
+"layout(location = 1) out vec4 velocityOutput;"
+"\n#endif\n"
 "const vec4 grayScaleWeights = vec4(0.30, 0.59, 0.11, 0.0);"
-"vec4 sample(sampler2D sampler, vec2 pos)"
-"{"
-"    ivec2 size = textureSize2D(sampler, 0);"
-"    if ((pos.s < 0) || (pos.t < 0) || (pos.s >= size.s) || (pos.t >= size.t))"
-"        return vec4(0.0, 0.0, 0.0, 1.0);"
-"    else"
-"        return texture2D(sampler, pos);"
-"}"
 "float luminance(vec4 color)"
 "{"
 "    vec4 scaledColor = color * grayScaleWeights;"
 "    return scaledColor.r + scaledColor.g + scaledColor.b;"
 "}"
+"vec4 tonemap(vec4 color)"
+"{"
+"    return (hdr != 0.0) ? vec4(1.0 - exp(-color.rgb), 1.0) : color;"
+"}"
 "void main()"
 "{"
-"    vec2 center = gl_TexCoord[0].st;"
-"    vec2 top = center + vec2(0.0, -1.0);"
-"    vec2 bottom = center + vec2(0.0, 1.0);"
-"    vec2 left = center + vec2(-1.0, 0.0);"
-"    vec2 right = center + vec2(1.0, 0.0);"
-"    vec4 inputColor = sample(inputSampler, center);"
-"    float inputLuminance = luminance(inputColor);"
-"    vec4 borderColor = (sample(stateSampler, top) +"
-"                        sample(stateSampler, left) +"
-"                        sample(stateSampler, right) +"
-"                        sample(stateSampler, bottom)) / 4.0;"
-"    float borderLuminance = luminance(borderColor);"
-"    vec4 stateColor = sample(stateSampler, center);"
+"    vec2 center = texCoord;"
+"\n#ifdef TILE_SKIPPING\n"
+"    center = gl_FragCoord.xy / vec2(textureSize(stateSampler, 0));"
+"\n#endif\n"
+"    vec4 inputColor = texture(inputSampler, center * inputScale);"
+"    float maskLuminance = luminance(texture(maskSampler, center * maskScale));"
+"    float inputLuminance = luminance(inputColor) * maskLuminance;"
+"    bool burn = (maskLuminance > 0.0) && (inputLuminance >= threshold);"
+"    vec4 stateColor = texture(stateSampler, center);"
 "    float stateLuminance = luminance(stateColor);"
-"    vec4 velocityVec = sample(velocitySampler, center);"
+"\n#ifdef COLOR_PASS\n"
+"    vec2 halfTexel = 0.5 / vec2(textureSize(velocitySampler, 0));"
+"    float velocity = texture(velocitySampler, clamp(center, halfTexel, 1.0 - halfTexel)).r;"
+"\n#elif defined(NO_VELOCITY)\n"
+"    float velocity = 0.0;"
+"\n#else\n"
+"\n#ifdef VELOCITY_PASS\n"
+"    vec2 texelSize = 1.0 / vec2(textureSize(velocitySampler, 0));"
+"    vec4 borderColor = (texture(stateSampler, center + vec2(0.0, -texelSize.t)) +"
+"                        texture(stateSampler, center + vec2(-texelSize.s, 0.0)) +"
+"                        texture(stateSampler, center + vec2(texelSize.s, 0.0)) +"
+"                        texture(stateSampler, center + vec2(0.0, texelSize.t))) / 4.0;"
+"\n#else\n"
+"    vec4 borderColor = (textureOffset(stateSampler, center, ivec2(0, -1)) +"
+"                        textureOffset(stateSampler, center, ivec2(-1, 0)) +"
+"                        textureOffset(stateSampler, center, ivec2(1, 0)) +"
+"                        textureOffset(stateSampler, center, ivec2(0, 1))) / 4.0;"
+"\n#endif\n"
+"    float borderLuminance = luminance(borderColor);"
+"    vec4 velocityVec = texture(velocitySampler, center);"
 "    float velocity = velocityVec.r * 0.0001;"
 "    velocity += (borderLuminance - stateLuminance) * 0.0002;"
 "    velocity += (inputLuminance - stateLuminance) * 0.0004;"
-"    gl_FragColor = vec4(velocity, velocity, velocity, 1.0);"
+"\n#endif\n"
+"    vec4 velocityColor = vec4(velocity, velocity, velocity, 1.0);"
+"\n#ifdef VELOCITY_PASS\n"
+"    velocityOutput = velocityColor;"
+"\n#else\n"
+"    if (spreadLevels > 0.0)"
+"        stateColor = mix(stateColor, texture(spreadSampler, center), spreadWeight);"
+"    vec4 outputColor = stateColor + velocityColor;"
+"    outputColor = vec4(abs(outputColor.r), abs(outputColor.g), abs(outputColor.b), 1.0);"
+"\n#if defined(ALWAYS_BURN)\n"
+"    outputColor = inputColor;"
+"\n#else\n"
+"\n#ifndef NO_DARKENING\n"
+"    vec4 darkenedColor = outputColor * vec4(darkening, darkening, darkening, 1.0);"
+"\n#else\n"
+"    vec4 darkenedColor = outputColor;"
+"\n#endif\n"
+"    if (hdr != 0.0)"
+"        outputColor = darkenedColor +"
+"            (burn ? vec4(inputColor.rgb, 0.0) : vec4(0.0));"
+"    else if (burn)"
+"        outputColor = inputColor;"
+"    else"
+"        outputColor = darkenedColor;"
+"\n#endif\n"
+"\n#ifdef DIRECT_OUTPUT\n"
+"    ivec2 pixel = ivec2(gl_FragCoord.xy);"
+"\n#if !defined(COLOR_PASS) && !defined(NO_VELOCITY)\n"
+"    imageStore(velocityImage, pixel, velocityColor);"
+"\n#endif\n"
+"    imageStore(colorImage, pixel, outputColor);"
+"    hostColor = tonemap(outputColor);"
+"\n#ifdef TILE_SKIPPING\n"
+"    if (max(outputColor.r, max(outputColor.g, outputColor.b)) >= activityEpsilon) {"
+"        ivec2 tile = pixel / 16;"
+"        uint tilesX = uint(textureSize(stateSampler, 0).x + 15) / 16u;"
+"        tileSteps[uint(tile.y) * tilesX + uint(tile.x)] = step;"
+"    }"
+"\n#endif\n"
+"\n#else\n"
+"\n#if !defined(COLOR_PASS) && !defined(NO_VELOCITY)\n"
+"    velocityOutput = velocityColor;"
+"\n#endif\n"
+"    colorOutput = outputColor;"
+"\n#endif\n"
+"\n#endif\n"
 "}";
 
-// A fragment shader that writes the output pixels.
-static const char * colorShaderSource =
+// A compute shader that performs the same update as the fragment shader. Each
+// work group loads a 16x16 tile of the color state and a one-pixel halo
+// around it into shared memory once, and evaluates the velocity and color of
+// the tile from there. Pixels outside the texture read as opaque black from
+// the border of the state texture.
+//
+// Only the tiles listed by tileShaderSource are processed, one work group per
+// tile. A tile that outputs any color component of at least half an 8-bit
+// step records the step number, so that the tile is processed on two more
+// steps after it has become dark, and both state textures contain the dark
+// result. The spread and the HDR mode work like in the fragment shader, but
+// the output is tonemapped when it is copied to the host.
+static const char * computeShaderSource =
+"#version 430\n"
+"layout(local_size_x = 16, local_size_y = 16) in;"
 "uniform sampler2D inputSampler;"
 "uniform sampler2D stateSampler;"
 "uniform sampler2D velocitySampler;"
-"uniform float threshold;"
-"uniform float darkening;"
+"uniform sampler2D maskSampler;"
+"uniform sampler2D spreadSampler;"
+PARAMETER_BLOCK
+"layout(binding = 0) writeonly uniform image2D colorImage;"
+"layout(binding = 1) writeonly uniform image2D velocityImage;"
+"layout(std430, binding = 0) writeonly buffer TileSteps { uint tileSteps[]; };"
+"layout(std430, binding = 1) readonly buffer TileList {"
+"    uint indirectArguments[7];"
+"    uint step;"
+"    uint tiles[];"
+"};"
+"const float activityEpsilon = 0.5 / 255.0;"
+"shared vec4 stateTile[18][18];"
+"shared uint tileLit;"
 "const vec4 grayScaleWeights = vec4(0.30, 0.59, 0.11, 0.0);"
-"vec4 sample(sampler2D sampler, vec2 pos)"
+"vec4 loadState(ivec2 pixel, ivec2 size)"
 "{"
-"    ivec2 size = textureSize2D(sampler, 0);"
-"    if ((pos.s < 0) || (pos.t < 0) || (pos.s >= size.s) || (pos.t >= size.t))"
-"        return vec4(0.0, 0.0, 0.0, 1.0);"
-"    else"
-"        return texture2D(sampler, pos);"
+"    return textureLod(stateSampler, (vec2(pixel) + 0.5) / vec2(size), 0.0);"
 "}"
 "float luminance(vec4 color)"
 "{"
@@ -117,43 +462,288 @@ static const char * colorShaderSource =
 "}"
 "void main()"
 "{"
-"    vec2 center = gl_TexCoord[0].st;"
-"    vec2 top = center + vec2(0.0, -1.0);"
-"    vec2 bottom = center + vec2(0.0, 1.0);"
-"    vec2 left = center + vec2(-1.0, 0.0);"
-"    vec2 right = center + vec2(1.0, 0.0);"
-"    vec4 inputColor = sample(inputSampler, center);"
-"    float inputLuminance = luminance(inputColor);"
-"    vec4 stateColor = sample(stateSampler, center);"
-"    float stateLuminance = luminance(stateColor);"
-"    vec4 velocityVec = sample(velocitySampler, center);"
-"    float velocity = velocityVec.r;"
-"    float outputLuminance = stateLuminance + velocity;"
-"    vec4 outputColor = stateColor + vec4(velocity, velocity, velocity, 1.0);"
-"    outputColor = vec4(abs(outputColor.r), abs(outputColor.g), abs(outputColor.b), 1.0);"
-"    if (inputLuminance >= threshold)"
-"        gl_FragColor = inputColor;"
-"    else"
-"        gl_FragColor = outputColor * vec4(darkening, darkening, darkening, 1.0);"
+"    ivec2 size = textureSize(stateSampler, 0);"
+"    uint packedTile = tiles[gl_WorkGroupID.x];"
+"    ivec2 tile = ivec2(packedTile & 0xFFFFu, packedTile >> 16);"
+"    ivec2 tileOrigin = tile * 16 - 1;"
+"    if (gl_LocalInvocationIndex == 0u)"
+"        tileLit = 0u;"
+"    for (uint i = gl_LocalInvocationIndex; i < 18u * 18u; i += 256u) {"
+"        ivec2 tilePos = ivec2(i % 18u, i / 18u);"
+"        stateTile[tilePos.y][tilePos.x] = loadState(tileOrigin + tilePos, size);"
+"    }"
+"    barrier();"
+"    ivec2 pixel = tile * 16 + ivec2(gl_LocalInvocationID.xy);"
+"    if ((pixel.x < size.x) && (pixel.y < size.y)) {"
+"        ivec2 t = ivec2(gl_LocalInvocationID.xy) + 1;"
+"        vec2 center = (vec2(pixel) + 0.5) / vec2(size);"
+"        vec4 inputColor = textureLod(inputSampler, center * inputScale, 0.0);"
+"        float maskLuminance = luminance(textureLod(maskSampler, center * maskScale, 0.0));"
+"        float inputLuminance = luminance(inputColor) * maskLuminance;"
+"        bool burn = (maskLuminance > 0.0) && (inputLuminance >= threshold);"
+"        vec4 borderColor = (stateTile[t.y - 1][t.x] +"
+"                            stateTile[t.y][t.x - 1] +"
+"                            stateTile[t.y][t.x + 1] +"
+"                            stateTile[t.y + 1][t.x]) / 4.0;"
+"        float borderLuminance = luminance(borderColor);"
+"        vec4 stateColor = stateTile[t.y][t.x];"
+"        float stateLuminance = luminance(stateColor);"
+"        vec4 velocityVec = texelFetch(velocitySampler, pixel, 0);"
+"        float velocity = velocityVec.r * 0.0001;"
+"        velocity += (borderLuminance - stateLuminance) * 0.0002;"
+"        velocity += (inputLuminance - stateLuminance) * 0.0004;"
+"        vec4 velocityColor = vec4(velocity, velocity, velocity, 1.0);"
+"        if (spreadLevels > 0.0)"
+"            stateColor = mix(stateColor, textureLod(spreadSampler, center, 0.0), spreadWeight);"
+"        vec4 outputColor = stateColor + velocityColor;"
+"        outputColor = vec4(abs(outputColor.r), abs(outputColor.g), abs(outputColor.b), 1.0);"
+"        vec4 darkenedColor = outputColor * vec4(darkening, darkening, darkening, 1.0);"
+"        if (hdr != 0.0)"
+"            outputColor = darkenedColor +"
+"                (burn ? vec4(inputColor.rgb, 0.0) : vec4(0.0));"
+"        else if (burn)"
+"            outputColor = inputColor;"
+"        else"
+"            outputColor = darkenedColor;"
+"        imageStore(velocityImage, pixel, velocityColor);"
+"        imageStore(colorImage, pixel, outputColor);"
+"        if (max(outputColor.r, max(outputColor.g, outputColor.b)) >= activityEpsilon)"
+"            atomicOr(tileLit, 1u);"
+"    }"
+"    barrier();"
+"    if ((gl_LocalInvocationIndex == 0u) && (tileLit != 0u))"
+"        tileSteps[uint(tile.y) * ((uint(size.x) + 15u) / 16u) + uint(tile.x)] = step;"
+"}";
+
+// A compute shader that selects the tiles that computeShaderSource or the
+// TILE_SKIPPING variant processes on the next step. A work group per tile
+// appends the tile to the list, and increments the work group count of the
+// indirect dispatch and the instance count of the indirect draw, if the tile
+// or one of its neighbours was lit on one of the two previous steps, or if
+// the input lights up the tile. The input lights up a pixel when it is above
+// the threshold, or when it would push the color to the equilibrium
+// 0.0004 * L * darkening / (1 - darkening) of at least half an 8-bit step.
+// Dark tiles that are skipped keep their previous state. Since L is scaled by
+// the mask, and the mask gates the threshold test, the input never lights up
+// the tiles that are masked out. With a nonzero spread, light reaches beyond
+// the neighbouring tiles in one step, so every tile is selected.
+static const char * tileShaderSource =
+"#version 430\n"
+"layout(local_size_x = 16, local_size_y = 16) in;"
+"uniform sampler2D inputSampler;"
+"uniform sampler2D stateSampler;"
+"uniform sampler2D maskSampler;"
+PARAMETER_BLOCK
+"layout(std430, binding = 0) readonly buffer TileSteps { uint tileSteps[]; };"
+"layout(std430, binding = 1) buffer TileList {"
+"    uint numTileGroups;"
+"    uint numTileGroupsY;"
+"    uint numTileGroupsZ;"
+"    uint tileVertexCount;"
+"    uint numTileInstances;"
+"    uint firstTileVertex;"
+"    uint baseTileInstance;"
+"    uint step;"
+"    uint tiles[];"
+"};"
+"const float activityEpsilon = 0.5 / 255.0;"
+"shared uint inputLit;"
+"const vec4 grayScaleWeights = vec4(0.30, 0.59, 0.11, 0.0);"
+"float luminance(vec4 color)"
+"{"
+"    vec4 scaledColor = color * grayScaleWeights;"
+"    return scaledColor.r + scaledColor.g + scaledColor.b;"
+"}"
+"void main()"
+"{"
+"    ivec2 size = textureSize(stateSampler, 0);"
+"    if (gl_LocalInvocationIndex == 0u)"
+"        inputLit = 0u;"
+"    barrier();"
+"    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);"
+"    if ((pixel.x < size.x) && (pixel.y < size.y)) {"
+"        vec2 center = (vec2(pixel) + 0.5) / vec2(size);"
+"        float maskLuminance = luminance(textureLod(maskSampler, center * maskScale, 0.0));"
+"        float inputLuminance = luminance(textureLod(inputSampler, center * inputScale, 0.0)) *"
+"                               maskLuminance;"
+"        if (((maskLuminance > 0.0) && (inputLuminance >= threshold)) ||"
+"            (inputLuminance * 0.0004 * darkening >= activityEpsilon * (1.0 - darkening)))"
+"            atomicOr(inputLit, 1u);"
+"    }"
+"    barrier();"
+"    if (gl_LocalInvocationIndex != 0u)"
+"        return;"
+"    ivec2 tile = ivec2(gl_WorkGroupID.xy);"
+"    ivec2 numTiles = ivec2(gl_NumWorkGroups.xy);"
+"    bool selected = (inputLit != 0u) || (spreadLevels > 0.0);"
+"    for (int y = max(tile.y - 1, 0); y <= min(tile.y + 1, numTiles.y - 1); ++y)"
+"        for (int x = max(tile.x - 1, 0); x <= min(tile.x + 1, numTiles.x - 1); ++x)"
+"            if (step - tileSteps[y * numTiles.x + x] <= 2u)"
+"                selected = true;"
+"    if (selected) {"
+"        tiles[atomicAdd(numTileGroups, 1u)] = (uint(tile.y) << 16) | uint(tile.x);"
+"        atomicAdd(numTileInstances, 1u);"
+"    }"
+"}";
+
+// A fragment shader that copies the color state to the host framebuffer
+// before the TILE_SKIPPING variant draws the listed tiles over it, so that the
+// skipped tiles show the state that they keep. The state is read at the
+// fragment position and tonemapped in HDR mode.
+static const char * skippedTileShaderSource =
+"uniform sampler2D stateSampler;"
+PARAMETER_BLOCK
+"layout(location = 0) out vec4 hostColor;"
+"void main()"
+"{"
+"    vec4 color = texelFetch(stateSampler, ivec2(gl_FragCoord.xy), 0);"
+"    hostColor = (hdr != 0.0) ? vec4(1.0 - exp(-color.rgb), 1.0) : color;"
+"}";
+
+// A fragment shader that writes the tonemapped color state to the host
+// framebuffer in HDR mode. It replaces the copy when the output is not
+// rendered directly to the host, so it costs the same read and write.
+static const char * tonemapShaderSource =
+"in vec2 texCoord;"
+"uniform sampler2D stateSampler;"
+"layout(location = 0) out vec4 hostColor;"
+"void main()"
+"{"
+"    vec4 color = texture(stateSampler, texCoord);"
+"    hostColor = vec4(1.0 - exp(-color.rgb), 1.0);"
+"}";
+
+// Fragment shaders of the dual filter that blurs the color state for the
+// spread. A down pass writes a texture of half the size of its source, with
+// the average of five bilinear taps at the center and the corners of the
+// pixel. An up pass writes a texture of twice the size of its source, with a
+// tent of eight bilinear taps around the pixel. Outside the state the taps
+// read as opaque black.
+static const char * spreadDownShaderSource =
+"in vec2 texCoord;"
+"uniform sampler2D spreadSampler;"
+"layout(location = 0) out vec4 spreadColor;"
+"void main()"
+"{"
+"    vec2 offset = 1.0 / vec2(textureSize(spreadSampler, 0));"
+"    spreadColor = (texture(spreadSampler, texCoord) * 4.0 +"
+"                   texture(spreadSampler, texCoord - offset) +"
+"                   texture(spreadSampler, texCoord + offset) +"
+"                   texture(spreadSampler, texCoord + vec2(offset.x, -offset.y)) +"
+"                   texture(spreadSampler, texCoord - vec2(offset.x, -offset.y))) / 8.0;"
+"}";
+
+static const char * spreadUpShaderSource =
+"in vec2 texCoord;"
+"uniform sampler2D spreadSampler;"
+"layout(location = 0) out vec4 spreadColor;"
+"void main()"
+"{"
+"    vec2 offset = 1.0 / vec2(textureSize(spreadSampler, 0));"
+"    vec2 halfOffset = offset * 0.5;"
+"    spreadColor = (texture(spreadSampler, texCoord + vec2(-offset.x, 0.0)) +"
+"                   texture(spreadSampler, texCoord + vec2(offset.x, 0.0)) +"
+"                   texture(spreadSampler, texCoord + vec2(0.0, -offset.y)) +"
+"                   texture(spreadSampler, texCoord + vec2(0.0, offset.y)) +"
+"                   (texture(spreadSampler, texCoord - halfOffset) +"
+"                    texture(spreadSampler, texCoord + halfOffset) +"
+"                    texture(spreadSampler, texCoord + vec2(halfOffset.x, -halfOffset.y)) +"
+"                    texture(spreadSampler, texCoord - vec2(halfOffset.x, -halfOffset.y))) * 2.0) / 12.0;"
 "}";
 
+// The input, state, velocity, mask, and spread textures are always bound to
+// the same texture units, and the parameter buffer to the same binding point,
+// so the units of a program are set only once after it has been linked. A
+// program does not need to use all the samplers. The program is bound through
+// the state tracker and left bound, since a program may be linked between two
+// steps of a frame, and the tracker has to know which program is current.
+static void bindProgramUnits(CFFGLStateTracker & state, GLuint program)
+{
+	static const char * samplers[] = {
+		"inputSampler",
+		"stateSampler",
+		"velocitySampler",
+		"maskSampler",
+		"spreadSampler"
+	};
+
+	state.UseProgram(program);
+	for (GLint unit = 0; unit < 5; ++unit) {
+		GLint location =
+			CFFGLProgramCache::GetUniformLocation(program, samplers[unit]);
+		if (location != -1)
+			glUniform1i(location, unit);
+	}
+
+	GLuint parameterBlock =
+		glGetUniformBlockIndex(program, "LightBrushParameters");
+	if (parameterBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, parameterBlock, PARAMETER_BLOCK_BINDING);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //  Constructor and destructor
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 FFGLLightBrush::FFGLLightBrush()
-: CFreeFrameGLPlugin()
+: CFFGLFeedbackEffect<GL_RGBA8, GL_R32F>()
 {
 	// Input properties
 	SetMinInputs(1);
-	SetMaxInputs(1);
+	SetMaxInputs(2);
+	SetTimeSupported(true);
 
 	// Parameters
+	// OpenGL objects are created in InitGL().
+	textureVelocityDivisor_ = 1;
+	timeSet_ = false;
+	simulationStarted_ = false;
+	hostTime_ = 0.0;
+	simulationTime_ = 0.0;
+	passthroughFrames_ = 0;
+	profiling_ = false;
+	profileFrames_ = 0;
+	whiteTexture_ = 0;
+	parameterBuffer_ = 0;
+	parametersChanged_ = false;
+	fill(inputScale_, inputScale_ + 2, 1.0f);
+	fill(maskScale_, maskScale_ + 2, 1.0f);
+	tileStepBuffer_ = 0;
+	tileListBuffer_ = 0;
+	tileVertexArray_ = 0;
+	numTiles_ = 0;
+	tileStep_ = 0;
+	tileStepsValid_ = false;
+	maskConnected_ = false;
+
 	threshold_ = 0.95;
 	SetParamInfo(FFPARAM_THRESHOLD, "Threshold", FF_TYPE_STANDARD, threshold_);
 	darkening_ = 0.95;
 	SetParamInfo(FFPARAM_DARKENING, "Darkening", FF_TYPE_STANDARD, darkening_);
 	SetParamInfo(FFPARAM_CLEAR, "Clear", FF_TYPE_EVENT, false);
+	computeShader_ = false;
+	SetParamInfo(FFPARAM_COMPUTE, "Compute Shader", FF_TYPE_BOOLEAN, computeShader_);
+	precisionValue_ = 0.25;
+	precision_ = 1;
+	SetParamInfo(FFPARAM_PRECISION, "Precision", FF_TYPE_STANDARD, precisionValue_);
+	velocityResolutionValue_ = 0.0;
+	velocityDivisor_ = 1;
+	SetParamInfo(FFPARAM_VELOCITY_RESOLUTION, "Velocity Res", FF_TYPE_STANDARD, velocityResolutionValue_);
+	SetParamInfo(FFPARAM_EXPORT, "Export", FF_TYPE_EVENT, false);
+	spread_ = 0.0;
+	SetParamInfo(FFPARAM_SPREAD, "Spread", FF_TYPE_STANDARD, spread_);
+	spreadSampler_ = 0;
+	spreadWidth_ = 0;
+	spreadHeight_ = 0;
+	spreadActive_ = false;
+	hdr_ = false;
+	SetParamInfo(FFPARAM_HDR, "HDR", FF_TYPE_BOOLEAN, hdr_);
+	skipDark_ = false;
+	SetParamInfo(FFPARAM_SKIP_DARK, "Skip Dark", FF_TYPE_BOOLEAN, skipDark_);
+	spreadMix_ = 0.5;
+	SetParamInfo(FFPARAM_SPREAD_MIX, "Spread Mix", FF_TYPE_STANDARD, spreadMix_);
+	exportPending_ = false;
+	exportDirectory_ = defaultExportDirectory();
 }
 
 FFGLLightBrush::~FFGLLightBrush()
@@ -164,262 +754,580 @@ FFGLLightBrush::~FFGLLightBrush()
 //  Methods
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+FFGLLightBrush::LazyProgram::LazyProgram()
+: program(0), ready(false), failed(false)
+{
+}
+
+bool FFGLLightBrush::LazyProgram::started() const
+{
+	return (program != 0) || failed;
+}
+
+void FFGLLightBrush::LazyProgram::start(
+	const CFFGLProgramCache::Shader * shaders, int numShaders)
+{
+	program = CFFGLProgramCache::Acquire(shaders, numShaders, true);
+	ready = false;
+	failed = program == 0;
+}
+
+bool FFGLLightBrush::LazyProgram::poll(CFFGLStateTracker & state)
+{
+	// Checks without waiting whether the program has been linked. The
+	// texture units and the parameter buffer binding are set once, when the
+	// program is first found to be linked.
+	if (ready)
+		return true;
+	if (program == 0)
+		return false;
+	CFFGLProgramCache::LinkStatus status =
+		CFFGLProgramCache::GetLinkStatus(program);
+	if (status == CFFGLProgramCache::STATUS_FAILED) {
+		CFFGLProgramCache::Release(program);
+		program = 0;
+		failed = true;
+	}
+	if (status != CFFGLProgramCache::STATUS_LINKED)
+		return false;
+
+	bindProgramUnits(state, program);
+	ready = true;
+	return true;
+}
+
+void FFGLLightBrush::LazyProgram::release()
+{
+	if (program != 0)
+		CFFGLProgramCache::Release(program);
+	program = 0;
+	ready = false;
+	failed = false;
+}
+
 void FFGLLightBrush::compileShaders()
 {
-	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertexShader, 1, &vertexShaderSource, NULL);
-	glCompileShader(vertexShader);
-	GLint isCompiled = 0;
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &isCompiled);
-	assert(isCompiled == GL_TRUE);
-
-	GLuint velocityShader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(velocityShader, 1, &velocityShaderSource, NULL);
-	glCompileShader(velocityShader);
-	glGetShaderiv(velocityShader, GL_COMPILE_STATUS, &isCompiled);
-	assert(isCompiled == GL_TRUE);
-
-	GLuint colorShader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(colorShader, 1, &colorShaderSource, NULL);
-	glCompileShader(colorShader);
-	glGetShaderiv(colorShader, GL_COMPILE_STATUS, &isCompiled);
-	assert(isCompiled == GL_TRUE);
-
-	velocityProgram_ = glCreateProgram();
-	glAttachShader(velocityProgram_, velocityShader);
-	glAttachShader(velocityProgram_, vertexShader);
-	glLinkProgram(velocityProgram_);
-	GLint isLinked = 0;
-	glGetProgramiv(velocityProgram_, GL_LINK_STATUS, &isLinked);
-	assert(isLinked == GL_TRUE);
-	glDetachShader(velocityProgram_, vertexShader);
-	glDetachShader(velocityProgram_, velocityShader);
-
-	colorProgram_ = glCreateProgram();
-	glAttachShader(colorProgram_, colorShader);
-	glAttachShader(colorProgram_, vertexShader);
-	glLinkProgram(colorProgram_);
-	isLinked = 0;
-	glGetProgramiv(colorProgram_, GL_LINK_STATUS, &isLinked);
-	assert(isLinked == GL_TRUE);
-	glDetachShader(colorProgram_, vertexShader);
-	glDetachShader(colorProgram_, colorShader);
-
-	glDeleteShader(colorShader);
-	glDeleteShader(velocityShader);
-	glDeleteShader(vertexShader);
-}
-
-void FFGLLightBrush::initializeTexture(GLuint texture,
-									   GLuint width,
-									   GLuint height,
-									   bool color) const
-{
-	glBindTexture(GL_TEXTURE_2D, texture);
-	vector<GLubyte> data(width * height * 4, 0x00);
-	if (color)
-		glTexImage2D(
-			GL_TEXTURE_2D,
-			0,
-			GL_RGBA8,
-			width, height,
-			0,
-			GL_BGRA,
-			GL_UNSIGNED_INT_8_8_8_8_REV,
-			&data[0]);
+	// Both shaders are prefixed with a header that selects the GLSL version
+	// and the output path. Instances in the same context share the program.
+	// The driver may link the program in the background.
+	const char * header = IsDirectOutputSupported() ?
+		directOutputShaderHeader : framebufferShaderHeader;
+	const CFFGLProgramCache::Shader shaders[] = {
+		{ GL_VERTEX_SHADER, header, vertexShaderSource },
+		{ GL_FRAGMENT_SHADER, header, lightBrushShaderSource }
+	};
+	program_.start(shaders, 2);
+}
+
+void FFGLLightBrush::compileComputeShader()
+{
+	const CFFGLProgramCache::Shader shader =
+		{ GL_COMPUTE_SHADER, "", computeShaderSource };
+	computeProgram_.start(&shader, 1);
+}
+
+void FFGLLightBrush::compileReducedShaders()
+{
+	// The velocity pass renders into a texture, while the color pass uses the
+	// same output path as the single pass shader.
+	string velocityHeader =
+		string(framebufferShaderHeader) + velocityPassDefinition;
+	string colorHeader = string(IsDirectOutputSupported() ?
+		directOutputShaderHeader : framebufferShaderHeader) +
+		colorPassDefinition;
+	const CFFGLProgramCache::Shader velocityShaders[] = {
+		{ GL_VERTEX_SHADER, velocityHeader.c_str(), vertexShaderSource },
+		{ GL_FRAGMENT_SHADER, velocityHeader.c_str(), lightBrushShaderSource }
+	};
+	const CFFGLProgramCache::Shader colorShaders[] = {
+		{ GL_VERTEX_SHADER, colorHeader.c_str(), vertexShaderSource },
+		{ GL_FRAGMENT_SHADER, colorHeader.c_str(), lightBrushShaderSource }
+	};
+	velocityProgram_.start(velocityShaders, 2);
+	colorProgram_.start(colorShaders, 2);
+}
+
+bool FFGLLightBrush::reducedProgramsReady()
+{
+	// The programs for reduced velocity resolution are compiled on first use.
+	// Until both have been linked, or if either fails, the velocity is
+	// simulated at full resolution.
+	if (!velocityProgram_.started())
+		compileReducedShaders();
+	bool velocityReady = velocityProgram_.poll(m_state);
+	bool colorReady = colorProgram_.poll(m_state);
+	return velocityReady && colorReady;
+}
+
+bool FFGLLightBrush::tonemapProgramReady()
+{
+	// The tonemapping program is compiled when HDR mode is first used. Until
+	// it has been linked, or if that fails, the state is copied as it is.
+	if (!tonemapProgram_.started()) {
+		const CFFGLProgramCache::Shader shaders[] = {
+			{ GL_VERTEX_SHADER, framebufferShaderHeader, vertexShaderSource },
+			{ GL_FRAGMENT_SHADER, framebufferShaderHeader, tonemapShaderSource }
+		};
+		tonemapProgram_.start(shaders, 2);
+	}
+	return tonemapProgram_.poll(m_state);
+}
+
+bool FFGLLightBrush::spreadProgramsReady()
+{
+	// The programs of the dual filter are compiled when the spread is first
+	// used. Until both have been linked, or if either fails, the spread is
+	// off.
+	if (!spreadDownProgram_.started()) {
+		const CFFGLProgramCache::Shader downShaders[] = {
+			{ GL_VERTEX_SHADER, framebufferShaderHeader, vertexShaderSource },
+			{ GL_FRAGMENT_SHADER, framebufferShaderHeader, spreadDownShaderSource }
+		};
+		spreadDownProgram_.start(downShaders, 2);
+		const CFFGLProgramCache::Shader upShaders[] = {
+			{ GL_VERTEX_SHADER, framebufferShaderHeader, vertexShaderSource },
+			{ GL_FRAGMENT_SHADER, framebufferShaderHeader, spreadUpShaderSource }
+		};
+		spreadUpProgram_.start(upShaders, 2);
+	}
+	bool downReady = spreadDownProgram_.poll(m_state);
+	bool upReady = spreadUpProgram_.poll(m_state);
+	return downReady && upReady;
+}
+
+int FFGLLightBrush::statePrecision() const
+{
+	return hdr_ ? HDR_PRECISION : precision_;
+}
+
+unsigned FFGLLightBrush::selectVariant() const
+{
+	// Velocity is added to the color before it is darkened, and it stays
+	// below 0.0007, which is less than half an 8-bit step. With 8-bit color
+	// and no darkening it is always rounded away. When every pixel burns in,
+	// the color does not depend on the state at all. The velocity state is
+	// then left as it was, and only 0.0001 times it carries over when the
+	// velocity is simulated again.
+	// The spread mixes blurred color into the state, so the velocity may
+	// change the rounding then.
+	// In HDR mode the input is added to the state, so every pixel still
+	// depends on the state and the velocity. With a mask, the pixels where
+	// the mask is black do not burn in even at threshold 0.
+	unsigned variant = 0;
+	if (darkening_ == 1.0f)
+		variant |= VARIANT_NO_DARKENING;
+	if ((threshold_ <= 0.0f) && !hdr_ && !maskConnected_)
+		variant |= VARIANT_ALWAYS_BURN;
+	if ((variant & VARIANT_ALWAYS_BURN) ||
+	    ((variant & VARIANT_NO_DARKENING) && (spread_ <= 0.0f) &&
+	     (statePrecisions[statePrecision()].colorFormat == GL_RGBA8)))
+		variant |= VARIANT_NO_VELOCITY;
+
+	// Dark tiles are skipped on the direct output path when the user has
+	// asked for it and the tile shader can be used. Skipping is not the
+	// default, because listing the tiles costs more than it saves when most
+	// of the frame is lit, and a pixel next to a skipped tile may round
+	// differently. With a nonzero spread, or when every pixel burns in, no
+	// tile could be skipped.
+	if (skipDark_ && computeSupported_ && IsDirectOutputSupported() &&
+	    (spread_ <= 0.0f) && !(variant & VARIANT_ALWAYS_BURN))
+		variant |= VARIANT_TILE_SKIPPING;
+	return variant;
+}
+
+GLuint FFGLLightBrush::variantProgram(unsigned variant)
+{
+	// The variants are compiled when they are first needed. Until a variant
+	// has been linked, or if that fails, the general program is used.
+	if (variant == 0)
+		return program_.program;
+	LazyProgram & programVariant = programVariants_[variant];
+	if (!programVariant.started()) {
+		bool tiles = (variant & VARIANT_TILE_SKIPPING) != 0;
+		string header = tiles ? tileSkippingShaderHeader :
+			IsDirectOutputSupported() ? directOutputShaderHeader :
+			framebufferShaderHeader;
+		for (int i = 0; i < NUM_VARIANT_FLAGS; ++i)
+			if (variant & (1 << i))
+				header += variantDefinitions[i];
+		const CFFGLProgramCache::Shader shaders[] = {
+			{ GL_VERTEX_SHADER, header.c_str(),
+			  tiles ? tileVertexShaderSource : vertexShaderSource },
+			{ GL_FRAGMENT_SHADER, header.c_str(), lightBrushShaderSource }
+		};
+		programVariant.start(shaders, 2);
+	}
+	return programVariant.poll(m_state) ? programVariant.program : program_.program;
+}
+
+bool FFGLLightBrush::tileProgramReady()
+{
+	// The tile shader selects the tiles that the compute shader or the
+	// TILE_SKIPPING variant processes. It is compiled on first use.
+	if (!tileProgram_.started()) {
+		const CFFGLProgramCache::Shader shader =
+			{ GL_COMPUTE_SHADER, "", tileShaderSource };
+		tileProgram_.start(&shader, 1);
+	}
+	return tileProgram_.poll(m_state);
+}
+
+bool FFGLLightBrush::skippedTileProgramReady()
+{
+	// The TILE_SKIPPING variant also needs the tile shader, and the program
+	// that copies the skipped tiles to the host. They are compiled on first
+	// use.
+	if (!skippedTileProgram_.started()) {
+		const CFFGLProgramCache::Shader shaders[] = {
+			{ GL_VERTEX_SHADER, tileSkippingShaderHeader, vertexShaderSource },
+			{ GL_FRAGMENT_SHADER, tileSkippingShaderHeader, skippedTileShaderSource }
+		};
+		skippedTileProgram_.start(shaders, 2);
+	}
+	bool skippedReady = skippedTileProgram_.poll(m_state);
+	bool tileReady = tileProgramReady();
+	return skippedReady && tileReady;
+}
+
+bool FFGLLightBrush::computeProgramReady()
+{
+	// The compute shader is compiled on first use. Until both programs have
+	// been linked, or if either fails, the fragment shader is used instead.
+	if (!computeProgram_.started())
+		compileComputeShader();
+	bool computeReady = computeProgram_.poll(m_state);
+	bool tileReady = tileProgramReady();
+	return computeReady && tileReady;
+}
+
+GLenum FFGLLightBrush::GetStateFormat(int buffer) const
+{
+	// The formats of the color and velocity buffers are selected by the
+	// precision parameter, or by HDR mode. When the setting changes, the base
+	// class copies the state into textures of the new formats.
+	const StatePrecision & precision = statePrecisions[statePrecision()];
+	if (buffer == COLOR_BUFFER)
+		return precision.colorFormat;
 	else
-		glTexImage2D(
-			GL_TEXTURE_2D,
-			0,
-			GL_R32F,
-			width, height,
-			0,
-			GL_RED,
-			GL_FLOAT,
-			&data[0]);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glBindTexture(GL_TEXTURE_2D, 0);
+		return precision.velocityFormat;
+}
+
+GLuint FFGLLightBrush::GetStateDivisor(int buffer) const
+{
+	// The velocity buffer is smaller when the velocity resolution is reduced.
+	if (buffer == VELOCITY_BUFFER)
+		return textureVelocityDivisor_;
+	else
+		return 1;
+}
+
+void FFGLLightBrush::SetStateTextureParameters(int buffer)
+{
+	// The shaders read pixels outside the state as opaque black from the
+	// texture border.
+	static const GLfloat black[] = { 0.0, 0.0, 0.0, 1.0 };
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, black);
+}
+
+void FFGLLightBrush::prepareTiles(GLuint tilesX, GLuint tilesY)
+{
+	// The step buffer has the number of the step when each tile was last
+	// lit. The list buffer starts with the arguments of the indirect
+	// dispatch and draw, and the number of the current step, followed by the
+	// tiles to process. The buffers are reallocated when the number of tiles
+	// changes.
+	GLuint numTiles = tilesX * tilesY;
+	if (tileStepBuffer_ == 0) {
+		glGenBuffers(1, &tileStepBuffer_);
+		glGenBuffers(1, &tileListBuffer_);
+
+		// The TILE_SKIPPING variant reads the listed tiles as an instanced
+		// vertex attribute.
+		glGenVertexArrays(1, &tileVertexArray_);
+		m_state.BindVertexArray(tileVertexArray_);
+		m_state.BindBuffer(GL_ARRAY_BUFFER, tileListBuffer_);
+		glVertexAttribIPointer(0, 1, GL_UNSIGNED_INT, 0,
+			(const GLvoid *)(TILE_LIST_HEADER * sizeof(GLuint)));
+		glVertexAttribDivisor(0, 1);
+		glEnableVertexAttribArray(0);
+	}
+	if (numTiles != numTiles_) {
+		m_state.BindBuffer(GL_SHADER_STORAGE_BUFFER, tileStepBuffer_);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, numTiles * sizeof(GLuint),
+		             NULL, GL_DYNAMIC_COPY);
+		m_state.BindBuffer(GL_SHADER_STORAGE_BUFFER, tileListBuffer_);
+		glBufferData(GL_SHADER_STORAGE_BUFFER,
+		             (TILE_LIST_HEADER + numTiles) * sizeof(GLuint),
+		             NULL, GL_DYNAMIC_COPY);
+		numTiles_ = numTiles;
+		tileStepsValid_ = false;
+	}
+
+	// After the state has been changed without tracking the tiles, every
+	// tile is processed until it has been found dark on two steps, as if it
+	// had been lit on the previous step.
+	++tileStep_;
+	if (!tileStepsValid_) {
+		GLuint previousStep = tileStep_ - 1;
+		m_state.BindBuffer(GL_SHADER_STORAGE_BUFFER, tileStepBuffer_);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+		                  GL_UNSIGNED_INT, &previousStep);
+		tileStepsValid_ = true;
+	}
+
+	// The tile shader counts the work groups and the tile instances from
+	// zero. A tile is drawn as a strip of four vertices.
+	const GLuint header[TILE_LIST_HEADER] = { 0, 1, 1, 4, 0, 0, 0, tileStep_ };
+	m_state.BindBuffer(GL_SHADER_STORAGE_BUFFER, tileListBuffer_);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), header);
 }
 
-void FFGLLightBrush::renderToTexture(GLuint texture) const
+void FFGLLightBrush::selectTiles()
 {
-	// Attach the texture to the framebuffer object.
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
-	glFramebufferTexture2D(
-		GL_FRAMEBUFFER,
-		GL_COLOR_ATTACHMENT0,
-		GL_TEXTURE_2D,
-		texture,
-		0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// Lists the tiles that are lit, or next to a lit tile, for the compute
+	// shader or the TILE_SKIPPING variant, which bind the same buffers.
+	GLuint tilesX = (GetWidth() + TILE_SIZE - 1) / TILE_SIZE;
+	GLuint tilesY = (GetHeight() + TILE_SIZE - 1) / TILE_SIZE;
+	prepareTiles(tilesX, tilesY);
+	m_state.UseProgram(tileProgram_.program);
+	m_state.BindStorageBuffer(0, tileStepBuffer_);
+	m_state.BindStorageBuffer(1, tileListBuffer_);
+	beginStage(STAGE_TILES);
+	glDispatchCompute(tilesX, tilesY, 1);
+	endStage();
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+	                GL_COMMAND_BARRIER_BIT |
+	                GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
 
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer_);
-	glViewport(viewport_.x, viewport_.y, viewport_.width, viewport_.height);
-	glCallList(displayList_);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+void FFGLLightBrush::drawTilesToHost(GLuint hostFBO, GLuint program,
+                                     bool copySkipped)
+{
+	// The listed tiles are drawn with the given program. When requested, the
+	// color output texture, which keeps the state of the skipped tiles, is
+	// first copied to the host framebuffer. The listed tiles cover the copy,
+	// so their image stores do not need to be ordered after its fetches. On
+	// llvmpipe one copy of the viewport was faster than a quad per skipped
+	// tile.
+	if (copySkipped) {
+		m_state.UseProgram(skippedTileProgram_.program);
+		m_state.BindTexture(1, GetOutputTexture(COLOR_BUFFER));
+		DrawToHost(hostFBO);
+		m_state.BindTexture(1, GetStateTexture(COLOR_BUFFER));
+		m_state.UseProgram(program);
+	}
+	m_state.BindDrawFramebuffer(hostFBO);
+	m_state.Viewport(0, 0, GetWidth(), GetHeight());
+	m_state.BindVertexArray(tileVertexArray_);
+	m_state.BindBuffer(GL_DRAW_INDIRECT_BUFFER, tileListBuffer_);
+	glDrawArraysIndirect(GL_TRIANGLE_STRIP,
+		(const GLvoid *)(TILE_DRAW_COMMAND * sizeof(GLuint)));
+}
+
+void FFGLLightBrush::copyToHost(GLuint hostFBO)
+{
+	// In HDR mode the state is tonemapped on the way, with a draw instead of
+	// the blit.
+	beginStage(STAGE_COPY);
+	if (hdr_ && tonemapProgramReady()) {
+		m_state.UseProgram(tonemapProgram_.program);
+		m_state.BindTexture(1, GetStateTexture(COLOR_BUFFER));
+		DrawToHost(hostFBO);
+	}
+	else {
+		CopyStateToHost(hostFBO);
+	}
+	endStage();
 }
 
-void FFGLLightBrush::copyTexture(GLuint texture, GLuint dst) const
+void FFGLLightBrush::blurState()
 {
-	// Attach the texture to the framebuffer object.
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
-	glFramebufferTexture2D(
-		GL_FRAMEBUFFER,
-		GL_COLOR_ATTACHMENT0,
-		GL_TEXTURE_2D,
-		texture,
-		0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	// The dual filter halves the resolution of the color state as many times
+	// as the spread selects, and doubles it back to half the resolution of
+	// the state. All the passes together touch fewer pixels than one pass at
+	// the full resolution, whatever the radius. The result is left bound to
+	// SPREAD_UNIT for the steps of the frame.
+	//
+	// The textures are taken from the pool of the state textures when the
+	// size of the state changes, and stored in half float, so that the faint
+	// edges of the blur are not rounded to black. The pool changes the
+	// binding of the active texture unit, so SPREAD_UNIT is activated and
+	// cleared first.
+	GLuint width = GetWidth();
+	GLuint height = GetHeight();
+	if (spreadFramebuffers_.empty()) {
+		spreadFramebuffers_.resize(SPREAD_LEVELS);
+		glGenFramebuffers(SPREAD_LEVELS, &spreadFramebuffers_[0]);
+	}
+	if ((width != spreadWidth_) || (height != spreadHeight_)) {
+		m_state.BindTexture(SPREAD_UNIT, 0);
+		releaseSpreadTextures();
+		for (int i = 0; i < SPREAD_LEVELS; ++i) {
+			spreadTextures_.push_back(m_texturePool.Acquire(
+				(width + (2 << i) - 1) >> (i + 1),
+				(height + (2 << i) - 1) >> (i + 1),
+				GL_RGBA16F));
+			m_state.BindDrawFramebuffer(spreadFramebuffers_[i]);
+			glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			                       GL_TEXTURE_2D, spreadTextures_[i], 0);
+		}
+		spreadWidth_ = width;
+		spreadHeight_ = height;
+	}
 
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer_);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst);
-	glBlitFramebuffer(
-		0, 0, viewport_.width, viewport_.height,
-		0, 0, viewport_.width, viewport_.height,
-		GL_COLOR_BUFFER_BIT, GL_NEAREST);
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	int levels = spreadLevels(spread_);
+	beginStage(STAGE_SPREAD);
+	m_state.BindSampler(SPREAD_UNIT, spreadSampler_);
+	m_state.UseProgram(spreadDownProgram_.program);
+	for (int i = 0; i < levels; ++i) {
+		m_state.BindTexture(SPREAD_UNIT,
+			(i == 0) ? GetStateTexture(COLOR_BUFFER) : spreadTextures_[i - 1]);
+		DrawToFramebuffer(spreadFramebuffers_[i],
+		                  (width + (2 << i) - 1) >> (i + 1),
+		                  (height + (2 << i) - 1) >> (i + 1));
+	}
+	m_state.UseProgram(spreadUpProgram_.program);
+	for (int i = levels - 2; i >= 0; --i) {
+		m_state.BindTexture(SPREAD_UNIT, spreadTextures_[i + 1]);
+		DrawToFramebuffer(spreadFramebuffers_[i],
+		                  (width + (2 << i) - 1) >> (i + 1),
+		                  (height + (2 << i) - 1) >> (i + 1));
+	}
+	m_state.BindTexture(SPREAD_UNIT, spreadTextures_[0]);
+	endStage();
+}
+
+void FFGLLightBrush::releaseSpreadTextures()
+{
+	// Gives the textures of the dual filter back to the pool. The
+	// framebuffers are kept, and the textures are attached again when they
+	// are next needed.
+	for (size_t i = 0; i < spreadTextures_.size(); ++i)
+		m_texturePool.Release(spreadTextures_[i]);
+	spreadTextures_.clear();
+	spreadWidth_ = 0;
+	spreadHeight_ = 0;
 }
 
 void FFGLLightBrush::clearState()
 {
-	glClearColor(0.0, 0.0, 0.0, 1.0);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer_);
-
-	// Bind velocity state texture to the framebuffer object and clear it.
-	glFramebufferTexture2D(
-		GL_FRAMEBUFFER,
-		GL_COLOR_ATTACHMENT0,
-		GL_TEXTURE_2D,
-		textures_[velocityStateTextureIndex_],
-		0);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	// Bind color state texture to the framebuffer object and clear it.
-	glFramebufferTexture2D(
-		GL_FRAMEBUFFER,
-		GL_COLOR_ATTACHMENT0,
-		GL_TEXTURE_2D,
-		textures_[colorStateTextureIndex_],
-		0);
-	glClear(GL_COLOR_BUFFER_BIT);
-
-	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glClearColor(0.0, 0.0, 0.0, 0.0);
+	static const GLfloat black[] = { 0.0, 0.0, 0.0, 1.0 };
+	ClearState(black);
+	tileStepsValid_ = false;
 }
 
 DWORD FFGLLightBrush::InitGL(const FFGLViewportStruct *vp)
 {
-	// GLEW helps to load dynamically some extensions.
+	// GLEW helps to load dynamically some extensions. The experimental flag is
+	// needed for loading the functions in a core profile context.
+	glewExperimental = GL_TRUE;
 	glewInit();
-	assert(GLEW_VERSION_2_0);
-
-	viewport_.x = 0;
-	viewport_.y = 0;
-	viewport_.width = vp->width;
-	viewport_.height = vp->height;
+	if (!GLEW_VERSION_3_3)
+		return FF_FAIL;
 
-	// Generate name for one framebuffer and four textures: the state and output
-	// texture for pixel color and velocity.
-	glGenFramebuffers(1, &framebuffer_);
-	glGenTextures(4, textures_);
+	// Allocate the state textures with correct size, and attach them to the
+	// framebuffer objects once, so that every frame only needs to bind a
+	// complete framebuffer. With OpenGL 4.2 the output is rendered directly to
+	// the host framebuffer, and the state textures are written using image
+	// load/store.
+	textureVelocityDivisor_ = 1;
+	m_state.Reset(0);
+	InitState(vp->width, vp->height);
+	m_state.Restore();
+
+	// Without a mask input, a white texture is used as the mask, so that the
+	// input can burn in everywhere.
+	static const GLubyte white[] = { 255, 255, 255, 255 };
+	glGenTextures(1, &whiteTexture_);
+	glBindTexture(GL_TEXTURE_2D, whiteTexture_);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA,
+	             GL_UNSIGNED_BYTE, white);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-	// Compile the GLSL shaders.
+	// The dual filter and the spread read their textures through a sampler
+	// object with bilinear filtering, so the state itself is still sampled
+	// with the filtering of the texture. Outside the state the taps read as
+	// opaque black, like the state.
+	static const GLfloat black[] = { 0.0, 0.0, 0.0, 1.0 };
+	glGenSamplers(1, &spreadSampler_);
+	glSamplerParameteri(spreadSampler_, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glSamplerParameteri(spreadSampler_, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(spreadSampler_, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+	glSamplerParameteri(spreadSampler_, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+	glSamplerParameterfv(spreadSampler_, GL_TEXTURE_BORDER_COLOR, black);
+
+	// The parameters are stored in a uniform buffer that all the programs
+	// read. It is filled on the first frame.
+	glGenBuffers(1, &parameterBuffer_);
+	glBindBuffer(GL_UNIFORM_BUFFER, parameterBuffer_);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(ShaderParameters), NULL,
+	             GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	parametersChanged_ = true;
+
+	// Start compiling the GLSL shaders. The compute shader is compiled only
+	// when it is first used. Program binaries are cached on disk when the
+	// driver supports it, so that the shaders are compiled only once per
+	// driver.
+	CFFGLProgramCache::EnableBinaryCache();
 	compileShaders();
-
-	// To pass data to the shader, we need the location of the uniforms (global
-	// variables defined in the shader code), and then call one of the
-	// glUniform* methods.
-	velocityShaderInputSampler_ =
-		glGetUniformLocation(velocityProgram_, "inputSampler");
-	assert(velocityShaderInputSampler_ != -1);
-	velocityShaderStateSampler_ =
-		glGetUniformLocation(velocityProgram_, "stateSampler");
-	assert(velocityShaderStateSampler_ != -1);
-	velocityShaderVelocitySampler_ =
-		glGetUniformLocation(velocityProgram_, "velocitySampler");
-	assert(velocityShaderVelocitySampler_ != -1);
-	colorShaderInputSampler_ =
-		glGetUniformLocation(colorProgram_, "inputSampler");
-	assert(colorShaderInputSampler_ != -1);
-	colorShaderStateSampler_ =
-		glGetUniformLocation(colorProgram_, "stateSampler");
-	assert(colorShaderStateSampler_ != -1);
-	colorShaderVelocitySampler_ =
-		glGetUniformLocation(colorProgram_, "velocitySampler");
-	assert(colorShaderVelocitySampler_ != -1);
-	colorShaderThreshold_ =
-		glGetUniformLocation(colorProgram_, "threshold");
-	assert(colorShaderThreshold_ != -1);
-	colorShaderDarkening_ =
-		glGetUniformLocation(colorProgram_, "darkening");
-	assert(colorShaderDarkening_ != -1);
-
-	// The input, state, and velocity textures are always bound to the same
-	// texture units.
-	glUseProgram(velocityProgram_);
-	glUniform1i(velocityShaderInputSampler_, 0);
-	glUniform1i(velocityShaderStateSampler_, 1);
-	glUniform1i(velocityShaderVelocitySampler_, 2);
-	glUseProgram(0);
-	glUseProgram(colorProgram_);
-	glUniform1i(colorShaderInputSampler_, 0);
-	glUniform1i(colorShaderStateSampler_, 1);
-	glUniform1i(colorShaderVelocitySampler_, 2);
-	glUseProgram(0);
-
-	// Initialize the textures with correct size. The velocity textyres are luminosity only.
-	initializeTexture(textures_[0], viewport_.width, viewport_.height);
-	initializeTexture(textures_[1], viewport_.width, viewport_.height);
-	initializeTexture(textures_[2], viewport_.width, viewport_.height, false);
-	initializeTexture(textures_[3], viewport_.width, viewport_.height, false);
-
-	// Start with textures 0 and 2 being the state, and 1 and 3 being the
-	// output, then switch.
-	colorStateTextureIndex_ = 0;
-	colorOutputTextureIndex_ = 1;
-	velocityStateTextureIndex_ = 2;
-	velocityOutputTextureIndex_ = 3;
-
-	// Create a list of operations for painting a texture on a quad that fills
-	// the entire viewport.
-	if (displayList_ == 0) {
-		displayList_ = glGenLists(1);
-		glNewList(displayList_, GL_COMPILE);
-		glColor4f(1.f, 1.f, 1.f, 1.f);
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-		glMatrixMode(GL_MODELVIEW);
-		glLoadIdentity();
-		glBegin(GL_QUADS);
-		//lower left
-		glTexCoord2d(0.0, 0.0);
-		glVertex2f(-1, -1);
-		//upper left
-		glTexCoord2d(0.0, 1.0);
-		glVertex2f(-1, 1);
-		//upper right
-		glTexCoord2d(1.0, 1.0);
-		glVertex2f(1, 1);
-		//lower right
-		glTexCoord2d(1.0, 0.0);
-		glVertex2f(1, -1);
-		glEnd();
-		glEndList();
-	}
+	passthroughFrames_ = 0;
+	if (program_.failed)
+		return FF_FAIL;
+	computeSupported_ = GLEW_VERSION_4_3 != 0;
+	clearPending_ = false;
 
 	return FF_SUCCESS;
 }
 
 DWORD FFGLLightBrush::DeInitGL()
 {
-	glDeleteFramebuffers(1, &framebuffer_);
-	glDeleteTextures(2, textures_);
-	glDeleteProgram(colorProgram_);
-	glDeleteProgram(velocityProgram_);
+	// The host calls DeInitGL() also when InitGL() has failed, so only the
+	// objects that have been created are deleted.
+	releaseSpreadTextures();
+	if (!spreadFramebuffers_.empty())
+		glDeleteFramebuffers(GLsizei(spreadFramebuffers_.size()),
+		                     &spreadFramebuffers_[0]);
+	spreadFramebuffers_.clear();
+	DeInitState();
+	if (whiteTexture_ != 0)
+		glDeleteTextures(1, &whiteTexture_);
+	whiteTexture_ = 0;
+	if (parameterBuffer_ != 0)
+		glDeleteBuffers(1, &parameterBuffer_);
+	parameterBuffer_ = 0;
+	if (spreadSampler_ != 0)
+		glDeleteSamplers(1, &spreadSampler_);
+	spreadSampler_ = 0;
+	stageTimer_.Clear();
+	exporter_.Clear();
+	if (tileStepBuffer_ != 0) {
+		glDeleteBuffers(1, &tileStepBuffer_);
+		glDeleteBuffers(1, &tileListBuffer_);
+		glDeleteVertexArrays(1, &tileVertexArray_);
+	}
+	tileStepBuffer_ = 0;
+	tileListBuffer_ = 0;
+	tileVertexArray_ = 0;
+	numTiles_ = 0;
+	computeProgram_.release();
+	tileProgram_.release();
+	skippedTileProgram_.release();
+	velocityProgram_.release();
+	colorProgram_.release();
+	tonemapProgram_.release();
+	spreadDownProgram_.release();
+	spreadUpProgram_.release();
+	for (map<unsigned, LazyProgram>::iterator it = programVariants_.begin();
+	     it != programVariants_.end(); ++it)
+		it->second.release();
+	programVariants_.clear();
+	program_.release();
 	return FF_SUCCESS;
 }
 
@@ -431,61 +1339,434 @@ DWORD FFGLLightBrush::ProcessOpenGL(ProcessOpenGLStruct *pGL)
 		return FF_FAIL;
 	FFGLTextureStruct &inputTexture = *(pGL->inputTextures[0]);
 
-	glUseProgram(velocityProgram_);
+	// The host calls us with the default OpenGL state and its own framebuffer
+	// object bound.
+	m_state.Reset(pGL->HostFBO);
+
+	// Until the shader program has been linked, the input is passed through.
+	if (!program_.poll(m_state)) {
+		PassThrough(inputTexture, pGL->HostFBO);
+		++passthroughFrames_;
+		m_state.Restore();
+		return FF_SUCCESS;
+	}
+
+	if (profiling_) {
+		stageTimer_.BeginFrame();
+		writeProfileLog();
+	}
+
+	GLuint velocityDivisor = 1;
+	if ((velocityDivisor_ > 1) && reducedProgramsReady())
+		velocityDivisor = velocityDivisor_;
+
+	// The textures are reallocated when the input size or one of the
+	// settings changes. The state is preserved and scaled to the new size.
+	textureVelocityDivisor_ = velocityDivisor;
+	if (UpdateState(inputTexture.Width, inputTexture.Height))
+		tileStepsValid_ = false;
+
+	if (clearPending_) {
+		clearState();
+		clearPending_ = false;
+	}
+
+	// The optional second input is a mask that limits where the input burns
+	// in. The input and the mask may be padded to larger hardware textures,
+	// in which case the shaders scale the texture coordinates to the part
+	// that has content.
+	GLuint maskTexture = whiteTexture_;
+	FFGLTexCoords maskCoords = { 1.0, 1.0 };
+	maskConnected_ =
+		(pGL->numInputTextures >= 2) && (pGL->inputTextures[1] != NULL);
+	if (maskConnected_) {
+		maskTexture = pGL->inputTextures[1]->Handle;
+		maskCoords = GetMaxGLTexCoords(*(pGL->inputTextures[1]));
+	}
+	updateScale(inputScale_, GetMaxGLTexCoords(inputTexture));
+	updateScale(maskScale_, maskCoords);
+
+	// The spread is off until the programs of the dual filter have been
+	// linked.
+	bool spreadActive = (spread_ > 0.0f) && spreadProgramsReady();
+	if (spreadActive != spreadActive_) {
+		spreadActive_ = spreadActive;
+		parametersChanged_ = true;
+	}
+
+	// Upload the parameters if they have been changed since the last frame.
+	if (parametersChanged_) {
+		ShaderParameters parameters = {
+			threshold_,
+			darkening_,
+			{ inputScale_[0], inputScale_[1] },
+			{ maskScale_[0], maskScale_[1] },
+			spreadActive_ ? GLfloat(spreadLevels(spread_)) : 0.0f,
+			hdr_ ? 1.0f : 0.0f,
+			spreadMix_
+		};
+		m_state.BindBuffer(GL_UNIFORM_BUFFER, parameterBuffer_);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(parameters), &parameters);
+		parametersChanged_ = false;
+	}
+	m_state.BindUniformBuffer(PARAMETER_BLOCK_BINDING, parameterBuffer_);
+
+	// Run as many simulation steps as are due. Unless the last step wrote its
+	// output directly to the host framebuffer, or no step was due, the latest
+	// state is copied there. The steps of a frame read the state blurred at
+	// the start of the frame.
+	int steps = scheduleSteps();
+	if (spreadActive_ && (steps > 0))
+		blurState();
+	bool hostWritten = false;
+	for (int i = 0; i < steps; ++i)
+		hostWritten = simulate(inputTexture, maskTexture, pGL->HostFBO,
+		                       i == steps - 1);
+	if (!hostWritten)
+		copyToHost(pGL->HostFBO);
+
+	// The latest state is read into a pixel buffer on request, and written
+	// to a file in the background once the read has finished. If the
+	// previous exports are still busy, the export is tried again on the next
+	// frame.
+	//
+	// In HDR mode the tonemapped state is rendered into the color output
+	// texture, which is free until the next step, and exported from there.
+	// The compute shader then processes all the tiles on the next step, since
+	// the skipped tiles would keep the tonemapped colors.
+	if (exportPending_) {
+		GLuint framebuffer = GetStateFramebuffer();
+		if (hdr_ && tonemapProgramReady()) {
+			m_state.UseProgram(tonemapProgram_.program);
+			m_state.BindTexture(1, GetStateTexture(COLOR_BUFFER));
+			DrawToOutput(COLOR_BUFFER);
+			framebuffer = GetOutputFramebuffer(COLOR_BUFFER);
+			tileStepsValid_ = false;
+		}
+		m_state.BindReadFramebuffer(framebuffer);
+		if (exporter_.Export(GetWidth(), GetHeight(), exportPath())) {
+			++exportCount;
+			exportPending_ = false;
+		}
+	}
+	exporter_.Update();
 
-	// Bind input texture to texture unit 0.
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, inputTexture.Handle);
+	m_state.Restore();
 
-	// Bind color state texture to texture unit 1.
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, textures_[colorStateTextureIndex_]);
+	return FF_SUCCESS;
+}
 
-	// Bind velocity state texture to texture unit 2.
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, textures_[velocityStateTextureIndex_]);
+void FFGLLightBrush::updateScale(GLfloat * scale, const FFGLTexCoords & coords)
+{
+	// The parameter buffer is updated when the size of the content or the
+	// padding changes.
+	if ((scale[0] != GLfloat(coords.s)) || (scale[1] != GLfloat(coords.t))) {
+		scale[0] = GLfloat(coords.s);
+		scale[1] = GLfloat(coords.t);
+		parametersChanged_ = true;
+	}
+}
 
-	// Write to velocity output texture.
-	renderToTexture(textures_[velocityOutputTextureIndex_]);
+bool FFGLLightBrush::simulate(const FFGLTextureStruct & inputTexture,
+                              GLuint maskTexture,
+                              GLuint hostFBO,
+                              bool lastStep)
+{
+	// The compute shader is used once it has been linked, unless the velocity
+	// resolution is reduced. Returns true if the output was written to the
+	// host framebuffer. Otherwise the caller copies the state there after the
+	// last step. The skipped tiles are written to the host framebuffer only on
+	// the last step of the frame, since the next step would cover them.
+	bool reduced = textureVelocityDivisor_ > 1;
+	bool compute = computeShader_ && computeSupported_ && !reduced &&
+		computeProgramReady();
+	bool hostWritten = false;
+
+	// Bind input texture to texture unit 0, color state texture to texture
+	// unit 1, velocity state texture to texture unit 2, and mask texture to
+	// texture unit 3. When the spread is on, the blurred state is bound to
+	// texture unit 4 by blurState().
+	m_state.BindTexture(0, inputTexture.Handle);
+	m_state.BindTexture(1, GetStateTexture(COLOR_BUFFER));
+	m_state.BindTexture(2, GetStateTexture(VELOCITY_BUFFER));
+	m_state.BindTexture(3, maskTexture);
+
+	bool tiles = compute;
+	if (compute) {
+		selectTiles();
+		m_state.UseProgram(computeProgram_.program);
+
+		// Write the color and velocity output textures as images in the
+		// listed tiles. The other tiles keep the state of two steps ago,
+		// which is dark as well.
+		BindOutputImages();
+		m_state.BindBuffer(GL_DISPATCH_INDIRECT_BUFFER, tileListBuffer_);
+		beginStage(STAGE_SIMULATE);
+		glDispatchComputeIndirect(0);
+		endStage();
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+		                GL_FRAMEBUFFER_BARRIER_BIT |
+		                GL_SHADER_STORAGE_BARRIER_BIT |
+		                GL_BUFFER_UPDATE_BARRIER_BIT);
+	}
+	else if (reduced) {
+		// Update the velocity at the reduced resolution first. The color pass
+		// then reads the new velocity from texture unit 2.
+		m_state.UseProgram(velocityProgram_.program);
+		beginStage(STAGE_VELOCITY);
+		DrawToOutput(VELOCITY_BUFFER);
+		endStage();
+		m_state.UseProgram(colorProgram_.program);
+		m_state.BindTexture(2, GetOutputTexture(VELOCITY_BUFFER));
+
+		beginStage(STAGE_COLOR);
+		if (IsDirectOutputSupported()) {
+			BindOutputImage(COLOR_BUFFER);
+			DrawToHost(hostFBO);
+			endStage();
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+			                GL_FRAMEBUFFER_BARRIER_BIT);
+			hostWritten = true;
+		}
+		else {
+			DrawToOutput();
+			endStage();
+		}
+	}
+	else if (IsDirectOutputSupported()) {
+		// Use the cheapest variant that matches the parameters. A variant
+		// that does not simulate the velocity writes only the color. The
+		// variant that skips dark tiles also needs the tile shader.
+		unsigned variant = selectVariant();
+		if ((variant & VARIANT_TILE_SKIPPING) && !skippedTileProgramReady())
+			variant &= ~VARIANT_TILE_SKIPPING;
+		GLuint program = variantProgram(variant);
+		bool velocity = (program == program_.program) ||
+			!(variant & VARIANT_NO_VELOCITY);
+		tiles = (program != program_.program) &&
+			(variant & VARIANT_TILE_SKIPPING);
+		if (tiles)
+			selectTiles();
+		m_state.UseProgram(program);
+
+		// Bind color and velocity output textures to image units 0 and 1, and
+		// write the output color to the host framebuffer. Like with the
+		// compute shader, the skipped tiles keep the state of two steps ago,
+		// and drawTilesToHost() copies that state to the host.
+		if (velocity)
+			BindOutputImages();
+		else
+			BindOutputImage(COLOR_BUFFER);
+		beginStage(STAGE_SIMULATE);
+		if (tiles)
+			drawTilesToHost(hostFBO, program, lastStep);
+		else
+			DrawToHost(hostFBO);
+		endStage();
+
+		// Make the image stores visible to texture fetches and framebuffer
+		// operations on the next frame, and the tile steps to the tile
+		// shader.
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT |
+		                GL_FRAMEBUFFER_BARRIER_BIT |
+		                (tiles ? GL_SHADER_STORAGE_BARRIER_BIT |
+		                         GL_BUFFER_UPDATE_BARRIER_BIT : 0));
+		hostWritten = true;
+	}
+	else {
+		unsigned variant = selectVariant();
+		GLuint program = variantProgram(variant);
+		bool velocity = (program == program_.program) ||
+			!(variant & VARIANT_NO_VELOCITY);
+		m_state.UseProgram(program);
+
+		// Write to color and velocity output textures in one pass, or only to
+		// the color texture.
+		beginStage(STAGE_SIMULATE);
+		if (velocity)
+			DrawToOutput();
+		else
+			DrawToOutput(COLOR_BUFFER);
+		endStage();
+	}
 
-	glUseProgram(colorProgram_);
+	// The tile activity is only tracked by the compute shader and the
+	// TILE_SKIPPING variant.
+	if (!tiles)
+		tileStepsValid_ = false;
 
-	// Pass the current parameter values to the shader program.
-	glUniform1f(colorShaderThreshold_, threshold_);
-	glUniform1f(colorShaderDarkening_, darkening_);
+	SwapState();
+	return hostWritten;
+}
 
-	// Bind input texture to texture unit 0.
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, inputTexture.Handle);
+int FFGLLightBrush::scheduleSteps()
+{
+	// Without SetTime() calls from the host, the simulation advances one step
+	// per frame.
+	if (!timeSet_)
+		return 1;
+
+	// The first frame and a time that jumps backwards start a new timeline.
+	const double stepTime = 1.0 / SIMULATION_RATE;
+	if (!simulationStarted_ || (hostTime_ < simulationTime_ - stepTime)) {
+		simulationTime_ = hostTime_;
+		simulationStarted_ = true;
+		return 1;
+	}
 
-	// Bind color state texture to texture unit 1.
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, textures_[colorStateTextureIndex_]);
+	// A step is taken when at least three quarters of it is due, so that a
+	// host running at the simulation rate with some jitter gets exactly one
+	// step per frame. If the host is too slow to keep up, the simulation is
+	// slowed down instead of running ever more steps.
+	int steps = int((hostTime_ - simulationTime_) / stepTime + 0.25);
+	if (steps > MAX_STEPS_PER_FRAME) {
+		simulationTime_ = hostTime_;
+		return MAX_STEPS_PER_FRAME;
+	}
+	simulationTime_ += steps * stepTime;
+	return steps;
+}
 
-	// Bind velocity output texture to texture unit 2.
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, textures_[velocityOutputTextureIndex_]);
+void FFGLLightBrush::setExportDirectory(const char * directory)
+{
+	exportDirectory_ = directory;
+}
 
-	// Write to color output texture.
-	renderToTexture(textures_[colorOutputTextureIndex_]);
+string FFGLLightBrush::exportPath()
+{
+	// The files are named after the local time, with a running number that
+	// keeps the names unique within a second, also between instances. The
+	// number is incremented when an export starts.
+	char timestamp[32];
+	time_t now = time(NULL);
+	strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", localtime(&now));
+	ostringstream oss;
+	oss << exportDirectory_;
+#ifdef _WIN32
+	oss << "\\";
+#else
+	oss << "/";
+#endif
+	oss << "LightBrush-" << timestamp << "-" << exportCount + 1 << ".tga";
+	return oss.str();
+}
 
-	glUseProgram(0);
+DWORD FFGLLightBrush::passthroughFrames() const
+{
+	return passthroughFrames_;
+}
 
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, 0);
+unsigned FFGLLightBrush::failedExports() const
+{
+	return exporter_.GetFailedExports();
+}
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, 0);
+void FFGLLightBrush::setProfiling(bool enabled, const char * logPath)
+{
+	// The queries are created on the next frame, when the OpenGL context is
+	// known to be current.
+	profiling_ = enabled;
+	if (profileLog_.is_open())
+		profileLog_.close();
+	if (enabled && (logPath != NULL))
+		profileLog_.open(logPath, ios::out | ios::app);
+	profileFrames_ = 0;
+}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+double FFGLLightBrush::stageTime(int stage, double percentile) const
+{
+	return stageTimer_.GetPercentile(stage, percentile);
+}
+
+void FFGLLightBrush::beginStage(int stage)
+{
+	if (profiling_)
+		stageTimer_.Begin(stage);
+}
+
+void FFGLLightBrush::endStage()
+{
+	if (profiling_)
+		stageTimer_.End();
+}
+
+void FFGLLightBrush::writeProfileLog()
+{
+	// Write the median and the 99th percentile of the stages that have been
+	// measured.
+	++profileFrames_;
+	if (!profileLog_.is_open() || (profileFrames_ % PROFILE_LOG_INTERVAL != 0))
+		return;
+
+	profileLog_ << fixed << setprecision(3) << "frame " << profileFrames_ << ":";
+	for (int stage = 0; stage < NUM_STAGES; ++stage) {
+		double median = stageTimer_.GetPercentile(stage, 50.0);
+		if (median < 0.0)
+			continue;
+		profileLog_ << " " << stageNames[stage] << " " << median << "/"
+		            << stageTimer_.GetPercentile(stage, 99.0);
+	}
+	profileLog_ << " ms (p50/p99), " << stageTimer_.GetDroppedFrames()
+	            << " frames dropped" << endl;
+}
 
-	// Copy the color output texture to the host framebuffer object.
-	copyTexture(textures_[colorOutputTextureIndex_], pGL->HostFBO);
+size_t FFGLLightBrush::stateMemoryUsage() const
+{
+	// There are two color textures at the viewport size and two velocity
+	// textures at the velocity resolution. The half float textures of the
+	// spread add about a third of the viewport size at 8 bytes per pixel.
+	const StatePrecision & precision = statePrecisions[statePrecision()];
+	size_t colorSize = size_t(2) * precision.colorBytes *
+		GetStateWidth(COLOR_BUFFER) * GetStateHeight(COLOR_BUFFER);
+	if (spread_ > 0.0f)
+		colorSize += size_t(8) * GetWidth() * GetHeight() / 3;
+	return colorSize +
+		size_t(2) * precision.velocityBytes *
+		GetStateWidth(VELOCITY_BUFFER) * GetStateHeight(VELOCITY_BUFFER);
+}
 
-	swap(velocityStateTextureIndex_, velocityOutputTextureIndex_);
-	swap(colorStateTextureIndex_, colorOutputTextureIndex_);
+char* FFGLLightBrush::GetParameterDisplay(DWORD dwIndex)
+{
+	ostringstream oss;
+	switch (dwIndex) {
+	case FFPARAM_PRECISION:
+		// Show the name of the precision setting and how much video memory
+		// the textures take.
+		oss << statePrecisions[statePrecision()].name << " "
+		    << (stateMemoryUsage() + 500000) / 1000000 << " MB";
+		break;
+
+	case FFPARAM_VELOCITY_RESOLUTION:
+		oss << "1/" << velocityDivisor_;
+		break;
+
+	case FFPARAM_SPREAD:
+		// Show the approximate radius of the blur.
+		if (spread_ > 0.0f)
+			oss << (1 << spreadLevels(spread_)) << " px";
+		else
+			oss << "Off";
+		break;
+
+	case FFPARAM_EXPORT:
+		// Tell the user if some images could not be written.
+		if (failedExports() > 0)
+			oss << failedExports() << " failed";
+		else
+			return CFreeFrameGLPlugin::GetParameterDisplay(dwIndex);
+		break;
+
+	default:
+		return CFreeFrameGLPlugin::GetParameterDisplay(dwIndex);
+	}
+	parameterDisplay_ = oss.str();
+	return &parameterDisplay_[0];
+}
 
+DWORD FFGLLightBrush::SetTime(double time)
+{
+	hostTime_ = time;
+	timeSet_ = true;
 	return FF_SUCCESS;
 }
 
@@ -504,6 +1785,41 @@ DWORD FFGLLightBrush::GetParameter(DWORD dwIndex)
 		*((float *)(unsigned)(&dwRet)) = darkening_;
 		return dwRet;
 
+	case FFPARAM_COMPUTE:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = computeShader_ ? 1.0f : 0.0f;
+		return dwRet;
+
+	case FFPARAM_PRECISION:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = precisionValue_;
+		return dwRet;
+
+	case FFPARAM_VELOCITY_RESOLUTION:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = velocityResolutionValue_;
+		return dwRet;
+
+	case FFPARAM_SPREAD:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = spread_;
+		return dwRet;
+
+	case FFPARAM_HDR:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = hdr_ ? 1.0f : 0.0f;
+		return dwRet;
+
+	case FFPARAM_SKIP_DARK:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = skipDark_ ? 1.0f : 0.0f;
+		return dwRet;
+
+	case FFPARAM_SPREAD_MIX:
+		//sizeof(DWORD) must == sizeof(float)
+		*((float *)(unsigned)(&dwRet)) = spreadMix_;
+		return dwRet;
+
 	default:
 		return FF_FAIL;
 	}
@@ -511,21 +1827,100 @@ DWORD FFGLLightBrush::GetParameter(DWORD dwIndex)
 
 DWORD FFGLLightBrush::SetParameter(const SetParameterStruct* pParam)
 {
+	// The parameter buffer is updated on the next frame if the threshold, the
+	// darkening, the spread or its mix, or the HDR mode changes.
+	float value;
+	bool enabled;
+
 	if (pParam != NULL) {
 		switch (pParam->ParameterNumber) {
 		case FFPARAM_THRESHOLD:
 			//sizeof(DWORD) must == sizeof(float)
-			threshold_ = *((float *)(unsigned)&(pParam->NewParameterValue));
+			value = *((float *)(unsigned)&(pParam->NewParameterValue));
+			if (value != threshold_) {
+				threshold_ = value;
+				parametersChanged_ = true;
+			}
 			break;
 
 		case FFPARAM_DARKENING:
 			//sizeof(DWORD) must == sizeof(float)
-			darkening_ = *((float *)(unsigned)&(pParam->NewParameterValue));
+			value = *((float *)(unsigned)&(pParam->NewParameterValue));
+			if (value != darkening_) {
+				darkening_ = value;
+				parametersChanged_ = true;
+			}
+			break;
+
+		case FFPARAM_COMPUTE:
+			//sizeof(DWORD) must == sizeof(float)
+			computeShader_ =
+				*((float *)(unsigned)&(pParam->NewParameterValue)) > 0.5f;
+			break;
+
+		case FFPARAM_PRECISION:
+			//sizeof(DWORD) must == sizeof(float)
+			precisionValue_ = *((float *)(unsigned)&(pParam->NewParameterValue));
+			precision_ = min(int(precisionValue_ * NUM_PRECISIONS),
+			                 NUM_PRECISIONS - 1);
+			precision_ = max(precision_, 0);
+			break;
+
+		case FFPARAM_VELOCITY_RESOLUTION:
+			//sizeof(DWORD) must == sizeof(float)
+			velocityResolutionValue_ = *((float *)(unsigned)&(pParam->NewParameterValue));
+			velocityDivisor_ = min(int(velocityResolutionValue_ * NUM_VELOCITY_DIVISORS),
+			                       NUM_VELOCITY_DIVISORS - 1);
+			velocityDivisor_ = 1 << max(velocityDivisor_, 0);
+			break;
+
+		case FFPARAM_SPREAD:
+			//sizeof(DWORD) must == sizeof(float)
+			value = *((float *)(unsigned)&(pParam->NewParameterValue));
+			if (value != spread_) {
+				spread_ = value;
+				parametersChanged_ = true;
+			}
+			break;
+
+		case FFPARAM_HDR:
+			// The state textures are reallocated in the new formats on the
+			// next frame.
+			//sizeof(DWORD) must == sizeof(float)
+			enabled = *((float *)(unsigned)&(pParam->NewParameterValue)) > 0.5f;
+			if (enabled != hdr_) {
+				hdr_ = enabled;
+				parametersChanged_ = true;
+			}
+			break;
+
+		case FFPARAM_SKIP_DARK:
+			//sizeof(DWORD) must == sizeof(float)
+			skipDark_ =
+				*((float *)(unsigned)&(pParam->NewParameterValue)) > 0.5f;
+			break;
+
+		case FFPARAM_SPREAD_MIX:
+			//sizeof(DWORD) must == sizeof(float)
+			value = *((float *)(unsigned)&(pParam->NewParameterValue));
+			if (value != spreadMix_) {
+				spreadMix_ = value;
+				parametersChanged_ = true;
+			}
 			break;
 
 		case FFPARAM_CLEAR:
+			// The state is cleared on the next frame, when the OpenGL context
+			// is known to be current.
+			if (pParam->NewParameterValue) {
+				clearPending_ = true;
+			}
+			break;
+
+		case FFPARAM_EXPORT:
+			// The state is exported after the next frame has been rendered.
 			if (pParam->NewParameterValue) {
-				clearState();
+				exportPending_ = true;
 			}
 			break;
 
@@ -17,10 +17,22 @@
 #ifndef FFGLLIGHTBRUSH_H
 #define FFGLLIGHTBRUSH_H
 
+#include <string>
+#include <fstream>
+#include <map>
+#include <vector>
 #include "FFGLPluginSDK.h"
+#include "FFGLLib.h"
+#include "FFGLFeedbackEffect.h"
+#include "FFGLFrameExporter.h"
+#include "FFGLProgramCache.h"
+#include "FFGLStageTimer.h"
 
+// The state consists of the color, which is also the output, and the
+// velocity of the pixels. The formats are selected by the precision
+// parameter.
 class FFGLLightBrush :
-	public CFreeFrameGLPlugin
+	public CFFGLFeedbackEffect<GL_RGBA8, GL_R32F>
 {
 public:
 	FFGLLightBrush();
@@ -38,48 +50,171 @@ public:
 	// helper methods
 
 	void compileShaders();
-	void initializeTexture(GLuint texture,
-		                   GLuint width,
-						   GLuint height,
-						   bool color = true) const;
-	void renderToTexture(GLuint texture) const;
-	void copyTexture(GLuint texture, GLuint dst) const;
+	void compileComputeShader();
+	void compileReducedShaders();
+	bool reducedProgramsReady();
+	bool tileProgramReady();
+	bool skippedTileProgramReady();
+	bool computeProgramReady();
+	bool tonemapProgramReady();
+	bool spreadProgramsReady();
+	int statePrecision() const;
+	unsigned selectVariant() const;
+	GLuint variantProgram(unsigned variant);
+	void prepareTiles(GLuint tilesX, GLuint tilesY);
+	void selectTiles();
+	void drawTilesToHost(GLuint hostFBO, GLuint program, bool copySkipped);
+	void copyToHost(GLuint hostFBO);
+	void blurState();
+	void releaseSpreadTextures();
+	void updateScale(GLfloat * scale, const FFGLTexCoords & coords);
+	bool simulate(const FFGLTextureStruct & inputTexture,
+	              GLuint maskTexture,
+	              GLuint hostFBO,
+	              bool lastStep);
+	int scheduleSteps();
 	void clearState();
+	void beginStage(int stage);
+	void endStage();
+	void writeProfileLog();
+	std::string exportPath();
+	size_t stateMemoryUsage() const;
+
+	// Number of frames where the input was passed through because the shaders
+	// had not been linked yet.
+	DWORD passthroughFrames() const;
+
+	// Number of exported images that could not be written.
+	unsigned failedExports() const;
+
+	// GPU time profiling of the processing stages. The times are measured
+	// with timer queries that are read back a few frames later. If a log file
+	// is given, the statistics are appended to it periodically.
+	enum Stage {
+		STAGE_TILES,
+		STAGE_SIMULATE,
+		STAGE_VELOCITY,
+		STAGE_COLOR,
+		STAGE_COPY,
+		STAGE_SPREAD,
+		NUM_STAGES
+	};
+	void setProfiling(bool enabled, const char * logPath = NULL);
+
+	// Returns a percentile (0 to 100) of the GPU time that a stage has taken
+	// per frame in milliseconds, or a negative value if the stage has not
+	// been measured.
+	double stageTime(int stage, double percentile) const;
+
+	// Sets the directory where the export event saves the state as a TGA
+	// image.
+	void setExportDirectory(const char * directory);
 
 	// FreeFrame plugin methods
 
+	char* GetParameterDisplay(DWORD dwIndex);
 	DWORD SetParameter(const SetParameterStruct* pParam);
 	DWORD GetParameter(DWORD dwIndex);
+	DWORD SetTime(double time);
 	DWORD ProcessOpenGL(ProcessOpenGLStruct* pGL);
 	DWORD InitGL(const FFGLViewportStruct *vp);
 	DWORD DeInitGL();
 
 protected:
-	FFGLViewportStruct viewport_;
-	GLuint displayList_ = 0;
+	// feedback effect methods
+
+	GLenum GetStateFormat(int buffer) const;
+	GLuint GetStateDivisor(int buffer) const;
+	void SetStateTextureParameters(int buffer);
 
 	// parameters
 	float threshold_;
 	float darkening_;
+	bool computeShader_;
+	float precisionValue_;
+	int precision_;
+	float velocityResolutionValue_;
+	int velocityDivisor_;
+	float spread_;
+	float spreadMix_;
+	bool hdr_;
+	bool skipDark_;
+	std::string parameterDisplay_;
+
+	// simulation time
+	bool timeSet_;
+	bool simulationStarted_;
+	double hostTime_;
+	double simulationTime_;
+
+	bool clearPending_;
+
+	// profiling
+	bool profiling_;
+	CFFGLStageTimer stageTimer_;
+	std::ofstream profileLog_;
+	unsigned profileFrames_;
+
+	// export
+	bool exportPending_;
+	CFFGLFrameExporter exporter_;
+	std::string exportDirectory_;
+
+	// A program that is compiled when it is first needed. The driver may link
+	// it in the background. Until it is ready, or if it fails, the caller
+	// falls back to another program. A failed program is not compiled again
+	// until the plugin is reinitialized.
+	struct LazyProgram {
+		GLuint program;
+		bool ready;
+		bool failed;
+
+		LazyProgram();
+		bool started() const;
+		void start(const CFFGLProgramCache::Shader * shaders, int numShaders);
+		bool poll(CFFGLStateTracker & state);
+		void release();
+	};
+
+	LazyProgram program_;
+
+	// specialized variants of the single pass program by their flags
+	std::map<unsigned, LazyProgram> programVariants_;
+
+	bool computeSupported_;
+	LazyProgram computeProgram_;
+	LazyProgram tileProgram_;
+	LazyProgram skippedTileProgram_;
+	LazyProgram velocityProgram_;
+	LazyProgram colorProgram_;
+	LazyProgram tonemapProgram_;
+	LazyProgram spreadDownProgram_;
+	LazyProgram spreadUpProgram_;
+	DWORD passthroughFrames_;
+	GLuint whiteTexture_;
+	GLuint parameterBuffer_;
+	GLuint spreadSampler_;
+	bool parametersChanged_;
+	bool maskConnected_;
+	GLfloat inputScale_[2];
+	GLfloat maskScale_[2];
+	GLuint textureVelocityDivisor_;
+
+	// activity of the tiles, when dark tiles are skipped
+	GLuint tileStepBuffer_;
+	GLuint tileListBuffer_;
+	GLuint tileVertexArray_;
+	GLuint numTiles_;
+	GLuint tileStep_;
+	bool tileStepsValid_;
 
-	GLuint velocityProgram_;
-	GLuint colorProgram_;
-	GLuint framebuffer_;
-	GLuint textures_[2];
-	int velocityStateTextureIndex_;
-	int velocityOutputTextureIndex_;
-	int colorStateTextureIndex_;
-	int colorOutputTextureIndex_;
-
-	// locations of the global shader variables
-	GLint velocityShaderInputSampler_;
-	GLint velocityShaderStateSampler_;
-	GLint velocityShaderVelocitySampler_;
-	GLint colorShaderInputSampler_;
-	GLint colorShaderStateSampler_;
-	GLint colorShaderVelocitySampler_;
-	GLint colorShaderThreshold_;
-	GLint colorShaderDarkening_;
+	// blurred copies of the color state for the spread, from half resolution
+	// down, and the size of the state that they were allocated for
+	std::vector<GLuint> spreadTextures_;
+	std::vector<GLuint> spreadFramebuffers_;
+	GLuint spreadWidth_;
+	GLuint spreadHeight_;
+	bool spreadActive_;
 };
 
 
@@ -0,0 +1,153 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#ifndef FFGLFEEDBACKEFFECT_STANDARD
+#define FFGLFEEDBACKEFFECT_STANDARD
+
+#include <GL/glew.h>
+#include "FFGLPluginSDK.h"
+#include "FFGLStateTracker.h"
+#include "FFGLTexturePool.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// \class		CFFGLFeedbackEffect
+///	\brief		CFFGLFeedbackEffect is a base class for plugins that compute each frame from the state of the previous one.
+/// \author		Seppo Enarvi
+/// \version	1.0.0.0
+///
+/// The CFFGLFeedbackEffect class keeps the state of a feedback effect in NUM_STATE_BUFFERS state buffers, each of which
+/// has a state texture that the effect reads and an output texture that it writes. SwapState() makes the output the
+/// state of the next step. The template arguments give the internal formats of the buffers, and a derived class can
+/// select other formats or a reduced resolution at run time by overriding GetStateFormat() and GetStateDivisor().
+///
+/// Textures are taken from a CFFGLTexturePool, and attached to framebuffer objects once, so that a step only binds a
+/// complete framebuffer. Buffer i is always attached to GL_COLOR_ATTACHMENT0 + i, so fragment output location i writes
+/// buffer i in every framebuffer, and buffer i is bound to image unit i for image stores. Buffer 0 is the output of the
+/// effect that is copied to the host. When the size or a format changes, the state is copied and scaled into the new
+/// textures.
+///
+/// With OpenGL 4.2 a shader can write the state as images and its output straight to the host framebuffer, which saves
+/// copying the output. The base class makes the bind calls through a CFFGLStateTracker that the derived class shares;
+/// Reset() and Restore() are left to the derived class.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <GLenum... StateFormats>
+class CFFGLFeedbackEffect :
+	public CFreeFrameGLPlugin
+{
+public:
+
+	/// The number of state buffers.
+	static const int NUM_STATE_BUFFERS = sizeof...(StateFormats);
+
+	CFFGLFeedbackEffect();
+	virtual ~CFFGLFeedbackEffect();
+
+protected:
+
+	/// Returns the internal format of a state buffer. The default implementation returns the template argument.
+	virtual GLenum GetStateFormat(int buffer) const;
+
+	/// Returns the number by which the width and height of a state buffer are divided. The default implementation
+	/// returns 1. Buffers with a reduced resolution are not attached to the framebuffer of all the buffers.
+	virtual GLuint GetStateDivisor(int buffer) const;
+
+	/// Called after a state texture has been taken from the pool, while it is bound to texture unit 1, for setting
+	/// texture parameters such as the wrap mode. The default implementation does nothing.
+	virtual void SetStateTextureParameters(int buffer);
+
+	/// Creates the framebuffers and the textures, and clears both the state and the output to zero. Has to be called
+	/// from InitGL() after GLEW has been initialized, with the tracker in the default state.
+	void InitState(GLuint width, GLuint height);
+
+	/// Deletes the framebuffers and the textures. Has to be called from DeInitGL(). Does nothing if InitState() has not
+	/// been called.
+	void DeInitState();
+
+	/// Reallocates the textures if the size, a format, or a divisor has changed, preserving the state. The state is
+	/// copied into the output textures too. Returns true if the textures were reallocated.
+	bool UpdateState(GLuint width, GLuint height);
+
+	/// Clears the state and the output textures. A single-channel buffer gets the red component of the color.
+	void ClearState(const GLfloat * color);
+
+	/// Makes the output textures the state of the next step.
+	void SwapState();
+
+	GLuint GetWidth() const;
+	GLuint GetHeight() const;
+	GLuint GetStateWidth(int buffer) const;
+	GLuint GetStateHeight(int buffer) const;
+	GLuint GetStateTexture(int buffer) const;
+	GLuint GetOutputTexture(int buffer) const;
+
+	/// Returns the framebuffer of the state textures. Its read buffer is buffer 0.
+	GLuint GetStateFramebuffer() const;
+
+	/// Returns the framebuffer of the output textures at full resolution.
+	GLuint GetOutputFramebuffer() const;
+
+	/// Returns a framebuffer where only the output texture of one buffer is attached.
+	GLuint GetOutputFramebuffer(int buffer) const;
+
+	/// Returns true if the shaders can write the state using image load/store, and the output directly to the host.
+	bool IsDirectOutputSupported() const;
+
+	/// Binds the output texture of a buffer to the image unit of the same number for writing.
+	void BindOutputImage(int buffer);
+
+	/// Binds the output textures of all the buffers for writing.
+	void BindOutputImages();
+
+	/// Draws a triangle that covers the output textures at full resolution.
+	void DrawToOutput();
+
+	/// Draws a triangle that covers the output texture of one buffer.
+	void DrawToOutput(int buffer);
+
+	/// Draws a triangle that covers the full-resolution area of the host framebuffer.
+	void DrawToHost(GLuint hostFBO);
+
+	/// Draws a triangle that covers a framebuffer of the given size, for example one of the derived class.
+	void DrawToFramebuffer(GLuint framebuffer, GLuint width, GLuint height);
+
+	/// Copies buffer 0 of the state to the host framebuffer.
+	void CopyStateToHost(GLuint hostFBO);
+
+	/// Copies the visible part of an input texture to the host framebuffer, for example while the shaders are still
+	/// being compiled.
+	void PassThrough(const FFGLTextureStruct & inputTexture, GLuint hostFBO);
+
+	CFFGLStateTracker m_state;
+
+	/// The pool of the state textures. A derived class may take its own textures from it, and release them before
+	/// DeInitState() deletes the pool.
+	CFFGLTexturePool m_texturePool;
+
+private:
+
+	void AllocateTextures(GLuint width, GLuint height);
+	void AttachTextures();
+	void ClearTextures(int side, const GLfloat * color);
+
+	bool m_directOutput;
+	bool m_clearTextureSupported;
+	GLuint m_width;
+	GLuint m_height;
+	int m_current;
+	GLuint m_textures[2][NUM_STATE_BUFFERS];
+	GLenum m_formats[NUM_STATE_BUFFERS];
+	GLuint m_divisors[NUM_STATE_BUFFERS];
+	GLuint m_bufferWidths[NUM_STATE_BUFFERS];
+	GLuint m_bufferHeights[NUM_STATE_BUFFERS];
+	GLuint m_framebuffers[2];
+	GLuint m_bufferFramebuffers[2][NUM_STATE_BUFFERS];
+	GLuint m_inputFramebuffer;
+	GLuint m_vertexArray;
+};
+
+#include "FFGLFeedbackEffect_inl.h"
+
+#endif
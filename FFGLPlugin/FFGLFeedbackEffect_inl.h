@@ -0,0 +1,413 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#include <cassert>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLFeedbackEffect constructor and destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <GLenum... StateFormats>
+CFFGLFeedbackEffect<StateFormats...>::CFFGLFeedbackEffect()
+: CFreeFrameGLPlugin()
+{
+	// OpenGL objects are created in InitState().
+	m_directOutput = false;
+	m_clearTextureSupported = false;
+	m_width = 0;
+	m_height = 0;
+	m_current = 0;
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		m_textures[0][i] = m_textures[1][i] = 0;
+		m_formats[i] = 0;
+		m_divisors[i] = 1;
+		m_bufferWidths[i] = m_bufferHeights[i] = 0;
+		m_bufferFramebuffers[0][i] = m_bufferFramebuffers[1][i] = 0;
+	}
+	m_framebuffers[0] = m_framebuffers[1] = 0;
+	m_inputFramebuffer = 0;
+	m_vertexArray = 0;
+}
+
+template <GLenum... StateFormats>
+CFFGLFeedbackEffect<StateFormats...>::~CFFGLFeedbackEffect()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLFeedbackEffect methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template <GLenum... StateFormats>
+GLenum CFFGLFeedbackEffect<StateFormats...>::GetStateFormat(int buffer) const
+{
+	static const GLenum formats[] = { StateFormats... };
+	assert((buffer >= 0) && (buffer < NUM_STATE_BUFFERS));
+	return formats[buffer];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetStateDivisor(int buffer) const
+{
+	return 1;
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::SetStateTextureParameters(int buffer)
+{
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::InitState(GLuint width, GLuint height)
+{
+	m_directOutput = GLEW_VERSION_4_2 != 0;
+	m_clearTextureSupported = GLEW_VERSION_4_4 || GLEW_ARB_clear_texture;
+
+	// The framebuffer of each side has all the full resolution buffers
+	// attached, and the buffer framebuffers one buffer each. The input
+	// framebuffer is used for passing the input through.
+	glGenFramebuffers(2, m_framebuffers);
+	glGenFramebuffers(NUM_STATE_BUFFERS, m_bufferFramebuffers[0]);
+	glGenFramebuffers(NUM_STATE_BUFFERS, m_bufferFramebuffers[1]);
+	glGenFramebuffers(1, &m_inputFramebuffer);
+
+	// Core profile requires a vertex array object to be bound when drawing,
+	// even though the vertex shader does not read any attributes.
+	glGenVertexArrays(1, &m_vertexArray);
+
+	// The contents of new textures are undefined, so they are cleared on the
+	// GPU.
+	static const GLfloat zero[] = { 0.0, 0.0, 0.0, 0.0 };
+	m_current = 0;
+	AllocateTextures(width, height);
+	AttachTextures();
+	ClearTextures(0, zero);
+	ClearTextures(1, zero);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::DeInitState()
+{
+	// Nothing has been created if InitGL() failed before calling InitState(),
+	// for example because the driver does not support OpenGL 3.3. The delete
+	// functions may not even have been loaded then.
+	if (m_vertexArray == 0)
+		return;
+
+	glDeleteVertexArrays(1, &m_vertexArray);
+	glDeleteFramebuffers(2, m_framebuffers);
+	glDeleteFramebuffers(NUM_STATE_BUFFERS, m_bufferFramebuffers[0]);
+	glDeleteFramebuffers(NUM_STATE_BUFFERS, m_bufferFramebuffers[1]);
+	glDeleteFramebuffers(1, &m_inputFramebuffer);
+	m_texturePool.Clear();
+	m_vertexArray = 0;
+	m_inputFramebuffer = 0;
+	m_framebuffers[0] = m_framebuffers[1] = 0;
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		m_textures[0][i] = m_textures[1][i] = 0;
+		m_bufferFramebuffers[0][i] = m_bufferFramebuffers[1][i] = 0;
+	}
+}
+
+template <GLenum... StateFormats>
+bool CFFGLFeedbackEffect<StateFormats...>::UpdateState(GLuint width, GLuint height)
+{
+	bool changed = (width != m_width) || (height != m_height);
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i)
+		changed = changed || (GetStateFormat(i) != m_formats[i]) ||
+			(GetStateDivisor(i) != m_divisors[i]);
+	if (!changed)
+		return false;
+
+	// Take new textures from the pool, and keep the old ones until the state
+	// has been copied.
+	GLuint oldTextures[2][NUM_STATE_BUFFERS];
+	GLuint oldWidths[NUM_STATE_BUFFERS];
+	GLuint oldHeights[NUM_STATE_BUFFERS];
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		oldTextures[0][i] = m_textures[0][i];
+		oldTextures[1][i] = m_textures[1][i];
+		oldWidths[i] = m_bufferWidths[i];
+		oldHeights[i] = m_bufferHeights[i];
+	}
+	AllocateTextures(width, height);
+
+	// The buffer framebuffers of the output side are not needed until the
+	// next step, so attach the new textures there and copy the old state into
+	// them. The blit converts between the formats and scales the image to the
+	// new size. The state is copied into the output textures as well, so that
+	// a step that does not write some buffer, or writes only part of it,
+	// leaves the state of that buffer defined.
+	int output = 1 - m_current;
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		m_state.BindReadFramebuffer(m_bufferFramebuffers[m_current][i]);
+		m_state.BindDrawFramebuffer(m_bufferFramebuffers[output][i]);
+		for (int side = 0; side < 2; ++side) {
+			glFramebufferTexture2D(
+				GL_DRAW_FRAMEBUFFER,
+				GL_COLOR_ATTACHMENT0 + i,
+				GL_TEXTURE_2D,
+				m_textures[side][i],
+				0);
+			glBlitFramebuffer(
+				0, 0, oldWidths[i], oldHeights[i],
+				0, 0, m_bufferWidths[i], m_bufferHeights[i],
+				GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		}
+	}
+
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		m_texturePool.Release(oldTextures[0][i]);
+		m_texturePool.Release(oldTextures[1][i]);
+	}
+	AttachTextures();
+	return true;
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::ClearState(const GLfloat * color)
+{
+	// The output textures are cleared as well, so that a buffer that the next
+	// steps do not write does not bring back the state from before the clear.
+	ClearTextures(0, color);
+	ClearTextures(1, color);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::SwapState()
+{
+	m_current = 1 - m_current;
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetWidth() const
+{
+	return m_width;
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetHeight() const
+{
+	return m_height;
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetStateWidth(int buffer) const
+{
+	return m_bufferWidths[buffer];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetStateHeight(int buffer) const
+{
+	return m_bufferHeights[buffer];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetStateTexture(int buffer) const
+{
+	return m_textures[m_current][buffer];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetOutputTexture(int buffer) const
+{
+	return m_textures[1 - m_current][buffer];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetStateFramebuffer() const
+{
+	return m_framebuffers[m_current];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetOutputFramebuffer() const
+{
+	return m_framebuffers[1 - m_current];
+}
+
+template <GLenum... StateFormats>
+GLuint CFFGLFeedbackEffect<StateFormats...>::GetOutputFramebuffer(int buffer) const
+{
+	return m_bufferFramebuffers[1 - m_current][buffer];
+}
+
+template <GLenum... StateFormats>
+bool CFFGLFeedbackEffect<StateFormats...>::IsDirectOutputSupported() const
+{
+	return m_directOutput;
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::BindOutputImage(int buffer)
+{
+	m_state.BindImageTexture(buffer, m_textures[1 - m_current][buffer],
+		GL_WRITE_ONLY, m_formats[buffer]);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::BindOutputImages()
+{
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i)
+		BindOutputImage(i);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::DrawToOutput()
+{
+	m_state.BindDrawFramebuffer(m_framebuffers[1 - m_current]);
+	m_state.Viewport(0, 0, m_width, m_height);
+	m_state.BindVertexArray(m_vertexArray);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::DrawToOutput(int buffer)
+{
+	m_state.BindDrawFramebuffer(m_bufferFramebuffers[1 - m_current][buffer]);
+	m_state.Viewport(0, 0, m_bufferWidths[buffer], m_bufferHeights[buffer]);
+	m_state.BindVertexArray(m_vertexArray);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::DrawToHost(GLuint hostFBO)
+{
+	// The output goes to the same place where CopyStateToHost() would blit
+	// it.
+	DrawToFramebuffer(hostFBO, m_width, m_height);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::DrawToFramebuffer(GLuint framebuffer, GLuint width, GLuint height)
+{
+	m_state.BindDrawFramebuffer(framebuffer);
+	m_state.Viewport(0, 0, width, height);
+	m_state.BindVertexArray(m_vertexArray);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::CopyStateToHost(GLuint hostFBO)
+{
+	// The read buffer of the framebuffer is buffer 0.
+	m_state.BindReadFramebuffer(m_framebuffers[m_current]);
+	m_state.BindDrawFramebuffer(hostFBO);
+	glBlitFramebuffer(
+		0, 0, m_width, m_height,
+		0, 0, m_width, m_height,
+		GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::PassThrough(const FFGLTextureStruct & inputTexture,
+                                                       GLuint hostFBO)
+{
+	// Attach the input texture to a framebuffer object of its own, and copy
+	// the visible part of it to the host framebuffer.
+	m_state.BindReadFramebuffer(m_inputFramebuffer);
+	glFramebufferTexture2D(
+		GL_READ_FRAMEBUFFER,
+		GL_COLOR_ATTACHMENT0,
+		GL_TEXTURE_2D,
+		inputTexture.Handle,
+		0);
+	m_state.BindDrawFramebuffer(hostFBO);
+	glBlitFramebuffer(
+		0, 0, inputTexture.Width, inputTexture.Height,
+		0, 0, inputTexture.Width, inputTexture.Height,
+		GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glFramebufferTexture2D(
+		GL_READ_FRAMEBUFFER,
+		GL_COLOR_ATTACHMENT0,
+		GL_TEXTURE_2D,
+		0,
+		0);
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::AllocateTextures(GLuint width, GLuint height)
+{
+	// Both sides get new textures in the current formats. A buffer with a
+	// divisor is smaller than the full resolution.
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		m_formats[i] = GetStateFormat(i);
+		m_divisors[i] = GetStateDivisor(i);
+		m_bufferWidths[i] = (width + m_divisors[i] - 1) / m_divisors[i];
+		m_bufferHeights[i] = (height + m_divisors[i] - 1) / m_divisors[i];
+		for (int side = 0; side < 2; ++side)
+			m_textures[side][i] = m_texturePool.Acquire(
+				m_bufferWidths[i], m_bufferHeights[i], m_formats[i]);
+	}
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		for (int side = 0; side < 2; ++side) {
+			m_state.BindTexture(1, m_textures[side][i]);
+			SetStateTextureParameters(i);
+		}
+	}
+	m_width = width;
+	m_height = height;
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::AttachTextures()
+{
+	// Buffer i is attached to color attachment i in every framebuffer, and
+	// the draw buffers map fragment output i to it. The framebuffer of all the
+	// buffers leaves out the buffers that have a reduced resolution.
+	GLenum drawBuffers[NUM_STATE_BUFFERS];
+	for (int side = 0; side < 2; ++side) {
+		m_state.BindDrawFramebuffer(m_framebuffers[side]);
+		for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+			bool full = m_divisors[i] == 1;
+			glFramebufferTexture2D(
+				GL_DRAW_FRAMEBUFFER,
+				GL_COLOR_ATTACHMENT0 + i,
+				GL_TEXTURE_2D,
+				full ? m_textures[side][i] : 0,
+				0);
+			drawBuffers[i] = full ? GL_COLOR_ATTACHMENT0 + i : GL_NONE;
+		}
+		glDrawBuffers(NUM_STATE_BUFFERS, drawBuffers);
+		m_state.BindReadFramebuffer(m_framebuffers[side]);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		assert(glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) ==
+		       GL_FRAMEBUFFER_COMPLETE);
+
+		for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+			m_state.BindDrawFramebuffer(m_bufferFramebuffers[side][i]);
+			glFramebufferTexture2D(
+				GL_DRAW_FRAMEBUFFER,
+				GL_COLOR_ATTACHMENT0 + i,
+				GL_TEXTURE_2D,
+				m_textures[side][i],
+				0);
+			for (int j = 0; j < NUM_STATE_BUFFERS; ++j)
+				drawBuffers[j] = (j == i) ? GL_COLOR_ATTACHMENT0 + i : GL_NONE;
+			glDrawBuffers(NUM_STATE_BUFFERS, drawBuffers);
+			m_state.BindReadFramebuffer(m_bufferFramebuffers[side][i]);
+			glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+			assert(glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) ==
+			       GL_FRAMEBUFFER_COMPLETE);
+		}
+	}
+}
+
+template <GLenum... StateFormats>
+void CFFGLFeedbackEffect<StateFormats...>::ClearTextures(int side, const GLfloat * color)
+{
+	// Textures can be cleared directly with OpenGL 4.4, otherwise through the
+	// framebuffer where only that buffer is attached.
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i) {
+		if (m_clearTextureSupported) {
+			glClearTexImage(m_textures[side][i], 0, GL_RGBA, GL_FLOAT, color);
+		}
+		else {
+			m_state.BindDrawFramebuffer(m_bufferFramebuffers[side][i]);
+			glClearBufferfv(GL_COLOR, i, color);
+		}
+	}
+}
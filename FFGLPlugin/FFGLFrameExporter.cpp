@@ -0,0 +1,204 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#include <cassert>
+#include <fstream>
+#include <GL/glew.h>
+#include "FFGLFrameExporter.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// TGA encoding
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Writes BGRA pixels, whose first row is the bottom row of the image, into an uncompressed 32-bit TGA file.
+bool writeTGA(const std::string & path, GLsizei width, GLsizei height, const GLubyte * pixels)
+{
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+	if (!file)
+		return false;
+
+	// Image type 2 is uncompressed true-color. The descriptor says that there are 8 alpha bits and the origin is at
+	// the lower left corner.
+	unsigned char header[18] = { 0 };
+	header[2] = 2;
+	header[12] = (unsigned char)(width & 0xFF);
+	header[13] = (unsigned char)((width >> 8) & 0xFF);
+	header[14] = (unsigned char)(height & 0xFF);
+	header[15] = (unsigned char)((height >> 8) & 0xFF);
+	header[16] = 32;
+	header[17] = 8;
+	file.write((const char *)header, sizeof(header));
+	file.write((const char *)pixels, std::streamsize(width) * height * 4);
+	return file.good();
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLFrameExporter constructor and destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CFFGLFrameExporter::CFFGLFrameExporter()
+{
+	for (int i = 0; i < NUM_BUFFERS; ++i) {
+		m_buffers[i].name = 0;
+		m_buffers[i].size = 0;
+		m_buffers[i].fence = 0;
+		m_buffers[i].state = BUFFER_FREE;
+		m_buffers[i].width = 0;
+		m_buffers[i].height = 0;
+		m_buffers[i].pixels = NULL;
+	}
+	m_stopping = false;
+	m_failedExports = 0;
+}
+
+CFFGLFrameExporter::~CFFGLFrameExporter()
+{
+	// The buffers cannot be deleted here, since the context may not be current anymore.
+	assert(!m_worker.joinable());
+	for (int i = 0; i < NUM_BUFFERS; ++i)
+		assert(m_buffers[i].name == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLFrameExporter methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool CFFGLFrameExporter::Export(GLsizei width, GLsizei height, const std::string & path)
+{
+	int index = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		while ((index < NUM_BUFFERS) && (m_buffers[index].state != BUFFER_FREE))
+			++index;
+	}
+	if (index == NUM_BUFFERS)
+		return false;
+
+	// The worker thread is started on the first export.
+	if (!m_worker.joinable()) {
+		m_stopping = false;
+		m_worker = std::thread(&CFFGLFrameExporter::Run, this);
+	}
+
+	// The buffer is reallocated only when the image size changes. The read into a pixel buffer object returns
+	// immediately, and the fence tells when the GPU has finished it.
+	Buffer & buffer = m_buffers[index];
+	GLsizeiptr size = GLsizeiptr(width) * height * 4;
+	if (buffer.name == 0)
+		glGenBuffers(1, &buffer.name);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.name);
+	if (buffer.size != size) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		buffer.size = size;
+	}
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	buffer.state = BUFFER_READING;
+	buffer.width = width;
+	buffer.height = height;
+	buffer.path = path;
+	return true;
+}
+
+void CFFGLFrameExporter::Update()
+{
+	for (int i = 0; i < NUM_BUFFERS; ++i) {
+		Buffer & buffer = m_buffers[i];
+		BufferState state;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			state = buffer.state;
+		}
+
+		if (state == BUFFER_READING) {
+			// Only check whether the read has finished, without waiting.
+			GLenum result = glClientWaitSync(buffer.fence, 0, 0);
+			if ((result != GL_ALREADY_SIGNALED) && (result != GL_CONDITION_SATISFIED))
+				continue;
+			glDeleteSync(buffer.fence);
+			buffer.fence = 0;
+
+			// The buffer stays mapped while the worker thread writes the file.
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.name);
+			buffer.pixels = (const GLubyte *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, buffer.size, GL_MAP_READ_BIT);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			buffer.state = BUFFER_WRITING;
+			m_jobs.push_back(i);
+			m_condition.notify_one();
+		}
+		else if (state == BUFFER_WRITTEN) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.name);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			buffer.pixels = NULL;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			buffer.state = BUFFER_FREE;
+		}
+	}
+}
+
+unsigned CFFGLFrameExporter::GetFailedExports() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_failedExports;
+}
+
+void CFFGLFrameExporter::Clear()
+{
+	// Reads that have not finished yet are waited for, so that they are written as well.
+	for (int i = 0; i < NUM_BUFFERS; ++i) {
+		if (m_buffers[i].state == BUFFER_READING)
+			glClientWaitSync(m_buffers[i].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	}
+	Update();
+
+	// The worker thread finishes the queued files before it exits.
+	if (m_worker.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopping = true;
+			m_condition.notify_one();
+		}
+		m_worker.join();
+	}
+	Update();
+
+	for (int i = 0; i < NUM_BUFFERS; ++i) {
+		Buffer & buffer = m_buffers[i];
+		assert(buffer.state == BUFFER_FREE);
+		if (buffer.name != 0)
+			glDeleteBuffers(1, &buffer.name);
+		buffer.name = 0;
+		buffer.size = 0;
+	}
+}
+
+void CFFGLFrameExporter::Run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		while (m_jobs.empty() && !m_stopping)
+			m_condition.wait(lock);
+		if (m_jobs.empty())
+			return;
+
+		// The file is written without holding the lock, so that the render thread never waits for the disk.
+		int index = m_jobs.front();
+		m_jobs.pop_front();
+		Buffer & buffer = m_buffers[index];
+		lock.unlock();
+		bool written = (buffer.pixels != NULL) && writeTGA(buffer.path, buffer.width, buffer.height, buffer.pixels);
+		lock.lock();
+		if (!written)
+			++m_failedExports;
+		buffer.state = BUFFER_WRITTEN;
+	}
+}
@@ -0,0 +1,84 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#ifndef FFGLFRAMEEXPORTER_STANDARD
+#define FFGLFRAMEEXPORTER_STANDARD
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "FFGL.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// \class		CFFGLFrameExporter
+///	\brief		CFFGLFrameExporter saves images from the GPU to disk without stalling the render thread.
+/// \author		Seppo Enarvi
+/// \version	1.0.0.0
+///
+/// The CFFGLFrameExporter class reads a framebuffer into one of NUM_BUFFERS pixel buffer objects, and inserts a fence
+/// after the read. Update() checks the fences without waiting. When a read has finished, the buffer is mapped and a
+/// worker thread writes the pixels into an uncompressed 32-bit TGA file straight from the mapped memory. The buffer is
+/// unmapped and reused on a later Update() call after the file has been written. The OpenGL calls must be made while
+/// the context is current.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class CFFGLFrameExporter
+{
+public:
+
+	/// The number of exports that can be in progress at the same time.
+	static const int NUM_BUFFERS = 3;
+
+	CFFGLFrameExporter();
+	~CFFGLFrameExporter();
+
+	/// Starts reading the color buffer of the bound read framebuffer into a file. Returns false if all the buffers are
+	/// busy, in which case the caller may try again on the next frame.
+	bool Export(GLsizei width, GLsizei height, const std::string & path);
+
+	/// Hands the finished reads to the worker thread, and recycles the buffers whose files have been written. Should
+	/// be called on every frame.
+	void Update();
+
+	/// Returns the number of files that could not be written.
+	unsigned GetFailedExports() const;
+
+	/// Waits until the pending files have been written, and deletes the buffers. Has to be called from DeInitGL().
+	void Clear();
+
+private:
+
+	enum BufferState {
+		BUFFER_FREE,
+		BUFFER_READING,
+		BUFFER_WRITING,
+		BUFFER_WRITTEN
+	};
+
+	struct Buffer {
+		GLuint name;
+		GLsizeiptr size;
+		GLsync fence;
+		BufferState state;
+		GLsizei width;
+		GLsizei height;
+		const GLubyte * pixels;
+		std::string path;
+	};
+
+	void Run();
+
+	Buffer m_buffers[NUM_BUFFERS];
+	std::thread m_worker;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<int> m_jobs;
+	bool m_stopping;
+	unsigned m_failedExports;
+};
+
+#endif
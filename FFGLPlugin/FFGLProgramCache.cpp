@@ -0,0 +1,446 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <GL/glew.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#elif defined(TARGET_OS_MAC)
+#include <OpenGL/OpenGL.h>
+#include <sys/stat.h>
+#else
+#include <GL/glx.h>
+#include <sys/stat.h>
+#endif
+#include "FFGLProgramCache.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Local functions and data
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Defined by KHR_parallel_shader_compile and ARB_parallel_shader_compile, which older GLEW versions do not know.
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+namespace {
+
+typedef unsigned long long SourceHash;
+
+// Programs are looked up by the OpenGL context and the hash of the shader sources.
+typedef std::pair<void *, SourceHash> ProgramKey;
+
+struct Program {
+	ProgramKey key;
+	int references;
+	CFFGLProgramCache::LinkStatus status;
+	// Where to store the binary after an asynchronous link has finished, or empty.
+	std::string binaryPath;
+	std::map<std::string, GLint> uniforms;
+};
+
+// Maps program names to programs. Program names are unique only within a context, but contexts that share objects
+// never return the same name twice, and contexts that do not share objects are told apart by the key.
+typedef std::multimap<GLuint, Program> ProgramMap;
+
+ProgramMap & programs()
+{
+	static ProgramMap instance;
+	return instance;
+}
+
+void * currentContext()
+{
+#ifdef _WIN32
+	return wglGetCurrentContext();
+#elif defined(TARGET_OS_MAC)
+	return CGLGetCurrentContext();
+#else
+	return glXGetCurrentContext();
+#endif
+}
+
+// 64-bit FNV-1a hash.
+SourceHash hashBytes(SourceHash hash, const void * data, size_t size)
+{
+	const unsigned char * bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+SourceHash hashShaders(const CFFGLProgramCache::Shader * shaders, int numShaders)
+{
+	SourceHash hash = 14695981039346656037ULL;
+	for (int i = 0; i < numShaders; ++i) {
+		// The terminating null characters separate the header from the source.
+		hash = hashBytes(hash, &shaders[i].type, sizeof(shaders[i].type));
+		hash = hashBytes(hash, shaders[i].header, strlen(shaders[i].header) + 1);
+		hash = hashBytes(hash, shaders[i].source, strlen(shaders[i].source) + 1);
+	}
+	return hash;
+}
+
+// The directory where program binaries are stored, or an empty string if the binary cache is disabled.
+std::string & binaryCacheDirectory()
+{
+	static std::string instance;
+	return instance;
+}
+
+void makeDirectory(const std::string & path)
+{
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+std::string defaultCacheDirectory()
+{
+#ifdef _WIN32
+	const char * base = getenv("LOCALAPPDATA");
+	if (base == NULL)
+		return std::string();
+	return std::string(base) + "\\FFGLProgramCache";
+#elif defined(TARGET_OS_MAC)
+	const char * home = getenv("HOME");
+	if (home == NULL)
+		return std::string();
+	return std::string(home) + "/Library/Caches/FFGLProgramCache";
+#else
+	const char * base = getenv("XDG_CACHE_HOME");
+	if ((base != NULL) && (*base != '\0'))
+		return std::string(base) + "/ffgl-programs";
+	const char * home = getenv("HOME");
+	if (home == NULL)
+		return std::string();
+	makeDirectory(std::string(home) + "/.cache");
+	return std::string(home) + "/.cache/ffgl-programs";
+#endif
+}
+
+bool parallelCompileSupported()
+{
+	GLint numExtensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+	for (GLint i = 0; i < numExtensions; ++i) {
+		const char * extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+		if ((strcmp(extension, "GL_KHR_parallel_shader_compile") == 0) ||
+		    (strcmp(extension, "GL_ARB_parallel_shader_compile") == 0))
+			return true;
+	}
+	return false;
+}
+
+bool binaryCacheSupported()
+{
+	if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+		return false;
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	return numFormats > 0;
+}
+
+// A binary is only valid for the driver that created it, so the file name is derived from the driver strings and the
+// hash of the shader sources.
+std::string binaryPath(SourceHash sourceHash)
+{
+	const char * strings[] = {
+		(const char *)glGetString(GL_VENDOR),
+		(const char *)glGetString(GL_RENDERER),
+		(const char *)glGetString(GL_VERSION)
+	};
+	SourceHash hash = sourceHash;
+	for (int i = 0; i < 3; ++i)
+		if (strings[i] != NULL)
+			hash = hashBytes(hash, strings[i], strlen(strings[i]) + 1);
+
+	char name[32];
+	sprintf(name, "%016llx.bin", hash);
+#ifdef _WIN32
+	return binaryCacheDirectory() + "\\" + name;
+#else
+	return binaryCacheDirectory() + "/" + name;
+#endif
+}
+
+// Program binary files start with this header.
+struct BinaryHeader {
+	char magic[8];
+	GLenum format;
+	GLint length;
+};
+
+const char binaryMagic[8] = { 'F', 'F', 'G', 'L', 'P', 'R', 'G', '1' };
+
+// Returns a program created from a binary file, or 0 if the file does not exist or the driver rejects the binary.
+GLuint loadProgramBinary(const std::string & path)
+{
+	FILE * file = fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return 0;
+
+	BinaryHeader header;
+	std::vector<char> data;
+	bool valid = (fread(&header, sizeof(header), 1, file) == 1) &&
+	             (memcmp(header.magic, binaryMagic, sizeof(binaryMagic)) == 0) &&
+	             (header.length > 0);
+	if (valid) {
+		// The length is checked against the rest of the file before allocating, so that a corrupted header cannot ask
+		// for an arbitrarily large buffer.
+		long offset = ftell(file);
+		valid = (offset >= 0) && (fseek(file, 0, SEEK_END) == 0) &&
+		        (ftell(file) - offset >= long(header.length)) &&
+		        (fseek(file, offset, SEEK_SET) == 0);
+	}
+	if (valid) {
+		data.resize(header.length);
+		valid = fread(&data[0], 1, data.size(), file) == data.size();
+	}
+	fclose(file);
+	if (!valid)
+		return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.format, &data[0], header.length);
+	GLint isLinked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+	if (isLinked != GL_TRUE) {
+		// Typically the driver has been updated. The file is replaced after compiling the sources.
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void saveProgramBinary(GLuint program, const std::string & path)
+{
+	BinaryHeader header;
+	memcpy(header.magic, binaryMagic, sizeof(binaryMagic));
+	header.length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &header.length);
+	if (header.length <= 0)
+		return;
+	std::vector<char> data(header.length);
+	glGetProgramBinary(program, header.length, &header.length, &header.format, &data[0]);
+	if (header.length <= 0)
+		return;
+
+	// Write to a temporary file first, so that other processes never read a partial binary.
+	std::string temporaryPath = path + ".tmp";
+	FILE * file = fopen(temporaryPath.c_str(), "wb");
+	if (file == NULL)
+		return;
+	bool written = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+	               (fwrite(&data[0], 1, header.length, file) == size_t(header.length));
+	if ((fclose(file) != 0) || !written) {
+		remove(temporaryPath.c_str());
+		return;
+	}
+	remove(path.c_str());
+	rename(temporaryPath.c_str(), path.c_str());
+}
+
+ProgramMap::iterator findProgram(GLuint program)
+{
+	void * context = currentContext();
+	std::pair<ProgramMap::iterator, ProgramMap::iterator> range = programs().equal_range(program);
+	for (ProgramMap::iterator it = range.first; it != range.second; ++it)
+		if (it->second.key.first == context)
+			return it;
+	return programs().end();
+}
+
+// Compiles the shaders and starts linking the program. The status is not queried, so that a driver that compiles in
+// parallel does not have to wait for the result.
+GLuint linkProgram(const CFFGLProgramCache::Shader * shaders, int numShaders, bool retrievable)
+{
+	GLuint program = glCreateProgram();
+	if (retrievable)
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	for (int i = 0; i < numShaders; ++i) {
+		const char * sources[] = { shaders[i].header, shaders[i].source };
+		GLuint shader = glCreateShader(shaders[i].type);
+		glShaderSource(shader, 2, sources, NULL);
+		glCompileShader(shader);
+		glAttachShader(program, shader);
+		// The shader is deleted when it is detached.
+		glDeleteShader(shader);
+	}
+	glLinkProgram(program);
+	return program;
+}
+
+// Writes a compile or link error to the debugger output on Windows, and to the standard error elsewhere.
+void logError(const char * what, const std::vector<char> & log)
+{
+	std::string message = std::string("FFGLProgramCache: ") + what + " failed";
+	if (!log.empty() && (log[0] != '\0'))
+		message += std::string(":\n") + &log[0];
+	message += "\n";
+#ifdef _WIN32
+	OutputDebugStringA(message.c_str());
+#else
+	fputs(message.c_str(), stderr);
+#endif
+}
+
+// Logs the info logs of the shaders that failed to compile, and the info log of the program.
+void logLinkErrors(GLuint program, const GLuint * shaders, GLsizei numShaders)
+{
+	for (GLsizei i = 0; i < numShaders; ++i) {
+		GLint isCompiled = 0;
+		glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &isCompiled);
+		if (isCompiled == GL_TRUE)
+			continue;
+		GLint length = 0;
+		glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &length);
+		std::vector<char> log(std::max(length, 1), '\0');
+		glGetShaderInfoLog(shaders[i], GLsizei(log.size()), NULL, &log[0]);
+		logError("Compiling a shader", log);
+	}
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+	std::vector<char> log(std::max(length, 1), '\0');
+	glGetProgramInfoLog(program, GLsizei(log.size()), NULL, &log[0]);
+	logError("Linking a program", log);
+}
+
+// Checks the result of linkProgram(), which blocks until the driver has finished, and stores the binary if a path is
+// given. A failure is logged and returned, so that the caller can fall back to another program.
+bool finishLinking(GLuint program, const std::string & binaryPath)
+{
+	GLint isLinked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+
+	GLuint attached[8];
+	GLsizei numAttached = 0;
+	glGetAttachedShaders(program, 8, &numAttached, attached);
+	if (isLinked != GL_TRUE)
+		logLinkErrors(program, attached, numAttached);
+	for (GLsizei i = 0; i < numAttached; ++i)
+		glDetachShader(program, attached[i]);
+
+	if (isLinked != GL_TRUE)
+		return false;
+	if (!binaryPath.empty())
+		saveProgramBinary(program, binaryPath);
+	return true;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLProgramCache methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+GLuint CFFGLProgramCache::Acquire(const Shader * shaders, int numShaders, bool async)
+{
+	ProgramKey key(currentContext(), hashShaders(shaders, numShaders));
+	for (ProgramMap::iterator it = programs().begin(); it != programs().end(); ++it) {
+		if (it->second.key == key) {
+			++it->second.references;
+			return it->first;
+		}
+	}
+
+	Program entry;
+	entry.key = key;
+	entry.references = 1;
+	entry.status = STATUS_LINKED;
+
+	// Try the binary cache before compiling the sources, and store the binary if the sources had to be compiled.
+	bool useBinaryCache = !binaryCacheDirectory().empty() && binaryCacheSupported();
+	std::string path;
+	GLuint program = 0;
+	if (useBinaryCache) {
+		path = binaryPath(key.second);
+		program = loadProgramBinary(path);
+	}
+	if (program == 0) {
+		program = linkProgram(shaders, numShaders, useBinaryCache);
+		if (async && parallelCompileSupported()) {
+			entry.status = STATUS_PENDING;
+			entry.binaryPath = path;
+		}
+		else if (!finishLinking(program, path)) {
+			glDeleteProgram(program);
+			return 0;
+		}
+	}
+
+	programs().insert(ProgramMap::value_type(program, entry));
+	return program;
+}
+
+CFFGLProgramCache::LinkStatus CFFGLProgramCache::GetLinkStatus(GLuint program)
+{
+	ProgramMap::iterator it = findProgram(program);
+	assert(it != programs().end());
+	if (it == programs().end())
+		return STATUS_FAILED;
+
+	Program & entry = it->second;
+	if (entry.status == STATUS_PENDING) {
+		GLint isComplete = GL_FALSE;
+		glGetProgramiv(program, GL_COMPLETION_STATUS_KHR, &isComplete);
+		if (isComplete != GL_TRUE)
+			return STATUS_PENDING;
+		entry.status = finishLinking(program, entry.binaryPath) ? STATUS_LINKED : STATUS_FAILED;
+	}
+	return entry.status;
+}
+
+void CFFGLProgramCache::EnableBinaryCache(const char * directory)
+{
+	std::string path = (directory != NULL) ? std::string(directory) : defaultCacheDirectory();
+	if (!path.empty())
+		makeDirectory(path);
+	binaryCacheDirectory() = path;
+}
+
+void CFFGLProgramCache::Release(GLuint program)
+{
+	ProgramMap::iterator it = findProgram(program);
+	assert(it != programs().end());
+	if (it == programs().end())
+		return;
+
+	if (--it->second.references == 0) {
+		glDeleteProgram(program);
+		programs().erase(it);
+	}
+}
+
+GLint CFFGLProgramCache::GetUniformLocation(GLuint program, const char * name)
+{
+	ProgramMap::iterator it = findProgram(program);
+	assert(it != programs().end());
+	if (it == programs().end())
+		return glGetUniformLocation(program, name);
+
+	std::map<std::string, GLint> & uniforms = it->second.uniforms;
+	std::map<std::string, GLint>::iterator uniform = uniforms.find(name);
+	if (uniform != uniforms.end())
+		return uniform->second;
+
+	GLint location = glGetUniformLocation(program, name);
+	uniforms[name] = location;
+	return location;
+}
@@ -0,0 +1,86 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#ifndef FFGLPROGRAMCACHE_STANDARD
+#define FFGLPROGRAMCACHE_STANDARD
+
+#include "FFGL.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// \class		CFFGLProgramCache
+///	\brief		CFFGLProgramCache shares linked shader programs between plugin instances.
+/// \author		Seppo Enarvi
+/// \version	1.0.0.0
+///
+/// The CFFGLProgramCache class compiles and links a shader program the first time an instance asks for it in an OpenGL 
+/// context, and returns the same program to the other instances that ask for identical shader sources in the same 
+/// context. Programs are identified by a hash of the shader types and sources, and reference counted, so that a 
+/// program is deleted when the last instance releases it. The uniform locations of a program are queried once and 
+/// shared as well.
+///
+/// Optionally, linked programs are also stored on disk using glGetProgramBinary(), so that the next time the host is 
+/// started, the programs can be loaded without compiling the sources. The binaries are keyed by the driver strings and 
+/// the source hash. When the driver rejects a binary, the sources are compiled and the binary is replaced.
+///
+/// When the driver supports KHR_parallel_shader_compile or ARB_parallel_shader_compile, programs can be linked 
+/// asynchronously. Acquire() then returns as soon as the compile has been started, and GetLinkStatus() tells when the 
+/// program can be used without blocking.
+///
+/// A program that fails to compile or link is reported as such, and the info logs are written to the debugger output on 
+/// Windows and to the standard error elsewhere.
+///
+/// All the methods have to be called with the OpenGL context current, i.e. from InitGL(), ProcessOpenGL(), or 
+/// DeInitGL(). The cache is not thread safe.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class CFFGLProgramCache
+{
+public:
+
+	/// One shader stage of a program. The shader source is the header followed by the body.
+	struct Shader {
+		GLenum type;
+		const char * header;
+		const char * source;
+	};
+
+	/// The state of a program returned by Acquire().
+	enum LinkStatus {
+		STATUS_PENDING,
+		STATUS_LINKED,
+		STATUS_FAILED
+	};
+
+	/// Returns a program linked from the given shaders, compiling it if the current context does not have it yet. Each 
+	/// successful call has to be matched by a call to Release().
+	///
+	/// \param	shaders		The shader stages of the program.
+	/// \param	numShaders	The number of shader stages.
+	/// \param	async		If true and the driver compiles shaders in parallel, returns without waiting for the link to 
+	///						finish. GetLinkStatus() has to return STATUS_LINKED before the program is used.
+	/// \return				The program name, or 0 if compiling or linking failed synchronously.
+	static GLuint Acquire(const Shader * shaders, int numShaders, bool async = false);
+
+	/// Returns whether a program returned by Acquire() is still being linked, or whether linking succeeded or failed. 
+	/// Does not block.
+	static LinkStatus GetLinkStatus(GLuint program);
+
+	/// Enables storing program binaries on disk. Requires OpenGL 4.1 or ARB_get_program_binary; otherwise programs are 
+	/// always compiled from the sources.
+	///
+	/// \param	directory	The cache directory, or NULL for a per-user directory (%LOCALAPPDATA%\FFGLProgramCache on 
+	///						Windows, ~/Library/Caches/FFGLProgramCache on OS X, and $XDG_CACHE_HOME/ffgl-programs on 
+	///						Linux).
+	static void EnableBinaryCache(const char * directory = NULL);
+
+	/// Decrements the reference count of a program, and deletes the program when it is not used anymore.
+	static void Release(GLuint program);
+
+	/// Returns the location of a uniform variable in a program returned by Acquire(). The location is queried from 
+	/// OpenGL only once per program.
+	static GLint GetUniformLocation(GLuint program, const char * name);
+};
+
+#endif
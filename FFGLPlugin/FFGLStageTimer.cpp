@@ -0,0 +1,128 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#include <cassert>
+#include <algorithm>
+#include <GL/glew.h>
+#include "FFGLStageTimer.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLStageTimer constructor and destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CFFGLStageTimer::CFFGLStageTimer()
+{
+	for (int i = 0; i <= FRAME_LATENCY; ++i)
+		m_frames[i].used = 0;
+	m_currentFrame = 0;
+	for (int i = 0; i < MAX_STAGES; ++i)
+		m_nextTime[i] = 0;
+	m_droppedFrames = 0;
+}
+
+CFFGLStageTimer::~CFFGLStageTimer()
+{
+	// The queries cannot be deleted here, since the context may not be current anymore.
+	for (int i = 0; i <= FRAME_LATENCY; ++i)
+		assert(m_frames[i].queries.empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLStageTimer methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void CFFGLStageTimer::BeginFrame()
+{
+	m_currentFrame = (m_currentFrame + 1) % (FRAME_LATENCY + 1);
+	Frame & frame = m_frames[m_currentFrame];
+	if (frame.used == 0)
+		return;
+
+	// The queries finish in order, so the results are available if the last one is.
+	GLuint available = GL_FALSE;
+	glGetQueryObjectuiv(frame.queries[frame.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (available == GL_FALSE) {
+		++m_droppedFrames;
+		frame.used = 0;
+		return;
+	}
+
+	GLuint64 elapsed[MAX_STAGES] = { 0 };
+	bool timed[MAX_STAGES] = { false };
+	for (size_t i = 0; i < frame.used; ++i) {
+		GLuint64 result = 0;
+		glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &result);
+		elapsed[frame.stages[i]] += result;
+		timed[frame.stages[i]] = true;
+	}
+	frame.used = 0;
+
+	for (int stage = 0; stage < MAX_STAGES; ++stage) {
+		if (!timed[stage])
+			continue;
+		std::vector<double> & times = m_times[stage];
+		double milliseconds = elapsed[stage] / 1000000.0;
+		if (times.size() < WINDOW_SIZE)
+			times.push_back(milliseconds);
+		else
+			times[m_nextTime[stage]] = milliseconds;
+		m_nextTime[stage] = (m_nextTime[stage] + 1) % WINDOW_SIZE;
+	}
+}
+
+void CFFGLStageTimer::Begin(int stage)
+{
+	assert((stage >= 0) && (stage < MAX_STAGES));
+	Frame & frame = m_frames[m_currentFrame];
+	if (frame.used == frame.queries.size()) {
+		GLuint query;
+		glGenQueries(1, &query);
+		frame.queries.push_back(query);
+		frame.stages.push_back(stage);
+	}
+	frame.stages[frame.used] = stage;
+	glBeginQuery(GL_TIME_ELAPSED, frame.queries[frame.used]);
+	++frame.used;
+}
+
+void CFFGLStageTimer::End()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+}
+
+double CFFGLStageTimer::GetPercentile(int stage, double percentile) const
+{
+	assert((stage >= 0) && (stage < MAX_STAGES));
+	if (m_times[stage].empty())
+		return -1.0;
+
+	std::vector<double> times(m_times[stage]);
+	size_t rank = size_t(percentile / 100.0 * (times.size() - 1) + 0.5);
+	rank = std::min(rank, times.size() - 1);
+	std::nth_element(times.begin(), times.begin() + rank, times.end());
+	return times[rank];
+}
+
+unsigned CFFGLStageTimer::GetDroppedFrames() const
+{
+	return m_droppedFrames;
+}
+
+void CFFGLStageTimer::Clear()
+{
+	for (int i = 0; i <= FRAME_LATENCY; ++i) {
+		Frame & frame = m_frames[i];
+		if (!frame.queries.empty())
+			glDeleteQueries(GLsizei(frame.queries.size()), &frame.queries[0]);
+		frame.queries.clear();
+		frame.stages.clear();
+		frame.used = 0;
+	}
+	for (int i = 0; i < MAX_STAGES; ++i) {
+		m_times[i].clear();
+		m_nextTime[i] = 0;
+	}
+	m_droppedFrames = 0;
+}
@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#ifndef FFGLSTAGETIMER_STANDARD
+#define FFGLSTAGETIMER_STANDARD
+
+#include <vector>
+#include "FFGL.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// \class		CFFGLStageTimer
+///	\brief		CFFGLStageTimer measures the GPU time of the stages of a frame without stalling the pipeline.
+/// \author		Seppo Enarvi
+/// \version	1.0.0.0
+///
+/// The CFFGLStageTimer class wraps each stage of a frame in a GL_TIME_ELAPSED query. The queries of a frame are read
+/// back FRAME_LATENCY frames later, and only if the GPU has finished them by then; otherwise the results of that frame
+/// are dropped instead of waiting. The GPU time that a stage takes per frame is kept for the last WINDOW_SIZE frames,
+/// and percentiles are computed from them. Stages are identified by small integers, and a stage may run several times
+/// during a frame. Queries cannot be nested. The timer must only be used while the OpenGL context is current.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class CFFGLStageTimer
+{
+public:
+
+	/// The maximum number of stages.
+	static const int MAX_STAGES = 8;
+
+	/// The number of frames after which the results are read back.
+	static const int FRAME_LATENCY = 3;
+
+	/// The number of frames from which the percentiles are computed.
+	static const int WINDOW_SIZE = 240;
+
+	CFFGLStageTimer();
+	~CFFGLStageTimer();
+
+	/// Starts a new frame, and collects the results of the frame that was started FRAME_LATENCY frames earlier if they
+	/// are available.
+	void BeginFrame();
+
+	/// Starts timing a stage of the current frame.
+	void Begin(int stage);
+
+	/// Stops timing the stage that was started last.
+	void End();
+
+	/// Returns a percentile (0 to 100) of the GPU time that a stage has taken per frame in milliseconds, or a negative
+	/// value if the stage has not been timed.
+	double GetPercentile(int stage, double percentile) const;
+
+	/// Returns the number of frames whose results were not available in time.
+	unsigned GetDroppedFrames() const;
+
+	/// Deletes the query objects and forgets the results. Has to be called from DeInitGL().
+	void Clear();
+
+private:
+
+	struct Frame {
+		std::vector<GLuint> queries;
+		std::vector<int> stages;
+		size_t used;
+	};
+
+	Frame m_frames[FRAME_LATENCY + 1];
+	int m_currentFrame;
+	std::vector<double> m_times[MAX_STAGES];
+	size_t m_nextTime[MAX_STAGES];
+	unsigned m_droppedFrames;
+};
+
+#endif
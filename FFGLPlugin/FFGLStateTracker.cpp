@@ -0,0 +1,208 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#include <cassert>
+#include <GL/glew.h>
+#include "FFGLStateTracker.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLStateTracker constructor
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CFFGLStateTracker::CFFGLStateTracker()
+{
+	Reset(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLStateTracker methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void CFFGLStateTracker::Reset(GLuint hostFBO)
+{
+	m_hostFBO = hostFBO;
+	m_drawFramebuffer = hostFBO;
+	m_readFramebuffer = hostFBO;
+	m_program = 0;
+	m_vertexArray = 0;
+	m_viewport[0] = m_viewport[1] = m_viewport[2] = m_viewport[3] = -1;
+	m_activeUnit = 0;
+	for (int i = 0; i < MAX_UNITS; ++i) {
+		m_textures[i] = 0;
+		m_samplers[i] = 0;
+		m_images[i] = 0;
+		m_uniformBuffers[i] = 0;
+		m_storageBuffers[i] = 0;
+	}
+	m_uniformBuffer = 0;
+	m_storageBuffer = 0;
+	m_dispatchIndirectBuffer = 0;
+	m_drawIndirectBuffer = 0;
+	m_arrayBuffer = 0;
+}
+
+void CFFGLStateTracker::Restore()
+{
+	for (GLuint i = MAX_UNITS; i-- > 0;) {
+		BindTexture(i, 0);
+		BindSampler(i, 0);
+		if (m_images[i] != 0) {
+			glBindImageTexture(i, 0, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
+			m_images[i] = 0;
+		}
+	}
+	for (GLuint i = 0; i < MAX_UNITS; ++i) {
+		if (m_uniformBuffers[i] != 0) {
+			glBindBufferBase(GL_UNIFORM_BUFFER, i, 0);
+			m_uniformBuffers[i] = 0;
+			m_uniformBuffer = 0;
+		}
+		if (m_storageBuffers[i] != 0) {
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, 0);
+			m_storageBuffers[i] = 0;
+			m_storageBuffer = 0;
+		}
+	}
+	BindBuffer(GL_UNIFORM_BUFFER, 0);
+	BindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	BindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+	BindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	BindBuffer(GL_ARRAY_BUFFER, 0);
+	if (m_activeUnit != 0) {
+		glActiveTexture(GL_TEXTURE0);
+		m_activeUnit = 0;
+	}
+	UseProgram(0);
+	BindVertexArray(0);
+	BindDrawFramebuffer(m_hostFBO);
+	BindReadFramebuffer(m_hostFBO);
+}
+
+void CFFGLStateTracker::BindDrawFramebuffer(GLuint framebuffer)
+{
+	if (m_drawFramebuffer != framebuffer) {
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+		m_drawFramebuffer = framebuffer;
+	}
+}
+
+void CFFGLStateTracker::BindReadFramebuffer(GLuint framebuffer)
+{
+	if (m_readFramebuffer != framebuffer) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		m_readFramebuffer = framebuffer;
+	}
+}
+
+void CFFGLStateTracker::UseProgram(GLuint program)
+{
+	if (m_program != program) {
+		glUseProgram(program);
+		m_program = program;
+	}
+}
+
+void CFFGLStateTracker::BindVertexArray(GLuint vertexArray)
+{
+	if (m_vertexArray != vertexArray) {
+		glBindVertexArray(vertexArray);
+		m_vertexArray = vertexArray;
+	}
+}
+
+void CFFGLStateTracker::Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	if ((m_viewport[0] != x) || (m_viewport[1] != y) ||
+	    (m_viewport[2] != width) || (m_viewport[3] != height)) {
+		glViewport(x, y, width, height);
+		m_viewport[0] = x;
+		m_viewport[1] = y;
+		m_viewport[2] = width;
+		m_viewport[3] = height;
+	}
+}
+
+void CFFGLStateTracker::BindTexture(GLuint unit, GLuint texture)
+{
+	assert(unit < MAX_UNITS);
+	if (m_textures[unit] == texture)
+		return;
+
+	if (m_activeUnit != unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		m_activeUnit = unit;
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+	m_textures[unit] = texture;
+}
+
+void CFFGLStateTracker::BindSampler(GLuint unit, GLuint sampler)
+{
+	assert(unit < MAX_UNITS);
+	if (m_samplers[unit] != sampler) {
+		glBindSampler(unit, sampler);
+		m_samplers[unit] = sampler;
+	}
+}
+
+void CFFGLStateTracker::BindImageTexture(GLuint unit, GLuint texture, GLenum access, GLenum format)
+{
+	assert(unit < MAX_UNITS);
+	if (m_images[unit] == texture)
+		return;
+
+	glBindImageTexture(unit, texture, 0, GL_FALSE, 0, access, format);
+	m_images[unit] = texture;
+}
+
+void CFFGLStateTracker::BindBuffer(GLenum target, GLuint buffer)
+{
+	GLuint * binding = NULL;
+	switch (target) {
+	case GL_UNIFORM_BUFFER:
+		binding = &m_uniformBuffer;
+		break;
+	case GL_SHADER_STORAGE_BUFFER:
+		binding = &m_storageBuffer;
+		break;
+	case GL_DISPATCH_INDIRECT_BUFFER:
+		binding = &m_dispatchIndirectBuffer;
+		break;
+	case GL_DRAW_INDIRECT_BUFFER:
+		binding = &m_drawIndirectBuffer;
+		break;
+	case GL_ARRAY_BUFFER:
+		binding = &m_arrayBuffer;
+		break;
+	}
+	assert(binding != NULL);
+	if (*binding == buffer)
+		return;
+
+	glBindBuffer(target, buffer);
+	*binding = buffer;
+}
+
+void CFFGLStateTracker::BindStorageBuffer(GLuint index, GLuint buffer)
+{
+	assert(index < MAX_UNITS);
+	if (m_storageBuffers[index] == buffer)
+		return;
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, index, buffer);
+	m_storageBuffers[index] = buffer;
+	m_storageBuffer = buffer;
+}
+
+void CFFGLStateTracker::BindUniformBuffer(GLuint index, GLuint buffer)
+{
+	assert(index < MAX_UNITS);
+	if (m_uniformBuffers[index] == buffer)
+		return;
+
+	glBindBufferBase(GL_UNIFORM_BUFFER, index, buffer);
+	m_uniformBuffers[index] = buffer;
+	m_uniformBuffer = buffer;
+}
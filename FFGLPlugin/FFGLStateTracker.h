@@ -0,0 +1,88 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#ifndef FFGLSTATETRACKER_STANDARD
+#define FFGLSTATETRACKER_STANDARD
+
+#include "FFGL.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// \class		CFFGLStateTracker
+///	\brief		CFFGLStateTracker skips redundant OpenGL bind calls.
+/// \author		Seppo Enarvi
+/// \version	1.0.0.0
+///
+/// The CFFGLStateTracker class remembers the framebuffer, program, texture, sampler, image, and buffer bindings that a plugin has made 
+/// during one ProcessOpenGL call, and only calls OpenGL when a binding actually changes. The FFGL specification 
+/// guarantees that the host calls ProcessOpenGL with the default OpenGL state, except for the host framebuffer object 
+/// being bound. The tracker starts from that state when Reset() is called, and Restore() returns to it before the 
+/// plugin hands control back to the host.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class CFFGLStateTracker
+{
+public:
+
+	/// The maximum number of texture and image units that the tracker manages.
+	static const int MAX_UNITS = 8;
+
+	CFFGLStateTracker();
+
+	/// Forgets the cached bindings and assumes the default FFGL state.
+	///
+	/// \param	hostFBO		The framebuffer object the host has bound, or 0 for the default framebuffer.
+	void Reset(GLuint hostFBO);
+
+	/// Binds the default FFGL state again, calling OpenGL only for the bindings that have been changed since Reset().
+	void Restore();
+
+	void BindDrawFramebuffer(GLuint framebuffer);
+	void BindReadFramebuffer(GLuint framebuffer);
+	void UseProgram(GLuint program);
+	void BindVertexArray(GLuint vertexArray);
+	void Viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+	/// Binds a 2D texture to a texture unit. The active texture unit is only changed when needed.
+	void BindTexture(GLuint unit, GLuint texture);
+
+	/// Binds a sampler object to a texture unit, overriding the sampling parameters of the texture bound there.
+	void BindSampler(GLuint unit, GLuint sampler);
+
+	/// Binds level 0 of a 2D texture to an image unit. Bindings are compared by the texture name only.
+	void BindImageTexture(GLuint unit, GLuint texture, GLenum access, GLenum format);
+
+	/// Binds a buffer to the generic GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER, GL_DISPATCH_INDIRECT_BUFFER, 
+	/// GL_DRAW_INDIRECT_BUFFER, or GL_ARRAY_BUFFER binding point.
+	void BindBuffer(GLenum target, GLuint buffer);
+
+	/// Binds a buffer to an indexed shader storage binding point. Like glBindBufferBase(), this also changes the 
+	/// generic shader storage binding.
+	void BindStorageBuffer(GLuint index, GLuint buffer);
+
+	/// Binds a buffer to an indexed uniform buffer binding point. This also changes the generic uniform buffer binding.
+	void BindUniformBuffer(GLuint index, GLuint buffer);
+
+private:
+
+	GLuint m_hostFBO;
+	GLuint m_drawFramebuffer;
+	GLuint m_readFramebuffer;
+	GLuint m_program;
+	GLuint m_vertexArray;
+	GLint m_viewport[4];
+	GLuint m_activeUnit;
+	GLuint m_textures[MAX_UNITS];
+	GLuint m_samplers[MAX_UNITS];
+	GLuint m_images[MAX_UNITS];
+	GLuint m_uniformBuffer;
+	GLuint m_storageBuffer;
+	GLuint m_dispatchIndirectBuffer;
+	GLuint m_drawIndirectBuffer;
+	GLuint m_arrayBuffer;
+	GLuint m_uniformBuffers[MAX_UNITS];
+	GLuint m_storageBuffers[MAX_UNITS];
+};
+
+#endif
@@ -0,0 +1,90 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#include <cassert>
+#include <algorithm>
+#include <GL/glew.h>
+#include "FFGLTexturePool.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLTexturePool constructor and destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+CFFGLTexturePool::CFFGLTexturePool()
+{
+}
+
+CFFGLTexturePool::~CFFGLTexturePool()
+{
+	// The textures cannot be deleted here, since the context may not be current anymore.
+	assert(m_used.empty() && m_free.empty());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CFFGLTexturePool methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+GLuint CFFGLTexturePool::Acquire(GLsizei width, GLsizei height, GLenum internalFormat, GLsizei levels)
+{
+	for (std::vector<Texture>::iterator it = m_free.begin(); it != m_free.end(); ++it) {
+		if ((it->width == width) && (it->height == height) && (it->internalFormat == internalFormat) &&
+		    (it->levels == levels)) {
+			m_used.push_back(*it);
+			m_free.erase(it);
+			return m_used.back().name;
+		}
+	}
+
+	Texture texture;
+	texture.width = width;
+	texture.height = height;
+	texture.internalFormat = internalFormat;
+	texture.levels = levels;
+	glGenTextures(1, &texture.name);
+	glBindTexture(GL_TEXTURE_2D, texture.name);
+	if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage) {
+		// Immutable storage saves the driver from checking completeness on every draw.
+		glTexStorage2D(GL_TEXTURE_2D, levels, internalFormat, width, height);
+	}
+	else {
+		// The transfer format and type only have to be compatible with the internal format, since no data is uploaded.
+		bool red = (internalFormat == GL_R8) || (internalFormat == GL_R16F) || (internalFormat == GL_R32F);
+		for (GLsizei level = 0; level < levels; ++level)
+			glTexImage2D(GL_TEXTURE_2D, level, internalFormat, std::max(width >> level, 1),
+			             std::max(height >> level, 1), 0, red ? GL_RED : GL_RGBA, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	m_used.push_back(texture);
+	return texture.name;
+}
+
+void CFFGLTexturePool::Release(GLuint texture)
+{
+	for (std::vector<Texture>::iterator it = m_used.begin(); it != m_used.end(); ++it) {
+		if (it->name == texture) {
+			m_free.push_back(*it);
+			m_used.erase(it);
+			break;
+		}
+	}
+
+	if (m_free.size() > MAX_FREE_TEXTURES) {
+		glDeleteTextures(1, &m_free.front().name);
+		m_free.erase(m_free.begin());
+	}
+}
+
+void CFFGLTexturePool::Clear()
+{
+	for (std::vector<Texture>::iterator it = m_used.begin(); it != m_used.end(); ++it)
+		glDeleteTextures(1, &it->name);
+	for (std::vector<Texture>::iterator it = m_free.begin(); it != m_free.end(); ++it)
+		glDeleteTextures(1, &it->name);
+	m_free.clear();
+	m_used.clear();
+}
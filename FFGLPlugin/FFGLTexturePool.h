@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2016 Seppo Enarvi
+// http://users.marjaniemi.com/seppo/
+//
+
+#ifndef FFGLTEXTUREPOOL_STANDARD
+#define FFGLTEXTUREPOOL_STANDARD
+
+#include <vector>
+#include "FFGL.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// \class		CFFGLTexturePool
+///	\brief		CFFGLTexturePool recycles 2D textures by size and format.
+/// \author		Seppo Enarvi
+/// \version	1.0.0.0
+///
+/// The CFFGLTexturePool class keeps textures that a plugin has released, so that they can be reused when a texture of 
+/// the same size and internal format is needed again, for example when the host switches back and forth between two 
+/// resolutions. At most MAX_FREE_TEXTURES textures are kept; beyond that the oldest ones are deleted. The pool must only 
+/// be used while the OpenGL context that created the textures is current.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class CFFGLTexturePool
+{
+public:
+
+	/// The maximum number of released textures that the pool keeps.
+	static const int MAX_FREE_TEXTURES = 8;
+
+	CFFGLTexturePool();
+	~CFFGLTexturePool();
+
+	/// Returns a texture with the given size, internal format, and number of mipmap levels. The contents of the 
+	/// texture are undefined. New textures have linear filtering without mipmaps, and use immutable storage when the 
+	/// driver supports ARB_texture_storage. The texture binding of the active texture unit is reset to 0.
+	GLuint Acquire(GLsizei width, GLsizei height, GLenum internalFormat, GLsizei levels = 1);
+
+	/// Gives a texture that was returned by Acquire() back to the pool.
+	void Release(GLuint texture);
+
+	/// Deletes all the textures, including the ones that are still in use. Has to be called from DeInitGL().
+	void Clear();
+
+private:
+
+	struct Texture {
+		GLuint name;
+		GLsizei width;
+		GLsizei height;
+		GLenum internalFormat;
+		GLsizei levels;
+	};
+
+	std::vector<Texture> m_used;
+	std::vector<Texture> m_free;
+};
+
+#endif